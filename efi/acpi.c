@@ -0,0 +1,190 @@
+/* this module reads the numa topology out of the acpi tables. the tables are
+ * in EfiACPIReclaimMemory, which init_mmap hands to the kernel as
+ * EfiConventionalMemory, so the loader condenses them into a numa_topology
+ * while they are still identity mapped. */
+#include <efi.h>
+#include <efilib.h>
+#include "efi-wrapper.h"
+#include "acpi.h"
+#include "opsys/numa.h"
+#include "opsys/virtual-memory.h"
+#include "util.h"
+
+static BOOLEAN
+checksum_ok(const void *Table, UINT64 Length)
+{
+    UINT8 Sum = 0;
+    for (UINT64 i = 0; i < Length; ++i)
+        Sum = (UINT8)(Sum + ((const UINT8*)Table)[i]);
+    return !Sum;
+}
+
+/* the table with the given signature from the xsdt, or NULL */
+static const ACPI_SDT_HEADER*
+find_table(const ACPI_RSDP *Rsdp, const char *Signature)
+{
+    if (Rsdp->Revision < 2 || !Rsdp->XsdtAddress)
+        return NULL;
+    const ACPI_SDT_HEADER *Xsdt = (void*)Rsdp->XsdtAddress;
+    if (!checksum_ok(Xsdt, Xsdt->Length))
+        return NULL;
+    UINT64 NumEntries = (Xsdt->Length - sizeof(*Xsdt)) / sizeof(UINT64);
+
+    for (UINT64 i = 0; i < NumEntries; ++i) {
+        /* the entries are only 4 byte aligned */
+        UINT64 Address;
+        CopyMem(&Address, (const UINT8*)(Xsdt + 1) + i * sizeof(UINT64),
+                sizeof(Address));
+        const ACPI_SDT_HEADER *Table = (void*)Address;
+        if (!CompareMem(Table->Signature, Signature, sizeof(Table->Signature))
+                && checksum_ok(Table, Table->Length))
+            return Table;
+    }
+
+    return NULL;
+}
+
+/* the node of a proximity domain, numbering new domains as they come.
+ * returns n_nodes if there are too many nodes. */
+static UINT32
+domain_node(struct numa_topology *Numa, UINT32 Domain)
+{
+    for (UINT32 node = 0; node < Numa->n_nodes; ++node) {
+        if (Numa->domains[node] == Domain)
+            return node;
+    }
+
+    if (Numa->n_nodes == MAX_NUMA_NODES) {
+        Print(L"numa: too many nodes, ignoring domain %u\n", Domain);
+        return Numa->n_nodes;
+    }
+    Numa->domains[Numa->n_nodes] = Domain;
+    return Numa->n_nodes++;
+}
+
+static void
+add_range(struct numa_topology *Numa, UINT64 Start, UINT64 End, UINT32 Node)
+{
+    /* the kernel splits memory between nodes at page granularity */
+    Start = ALIGN_UP(Start, PAGE_SIZE);
+    End = PAGE_BASE(End);
+    if (Start >= End)
+        return;
+    if (Numa->n_ranges == MAX_NUMA_RANGES) {
+        Print(L"numa: too many memory ranges, ignoring 0x%lx\n", Start);
+        return;
+    }
+
+    /* insertion sort, like the kernel's memory map index */
+    UINT32 i = Numa->n_ranges++;
+    for (; i && Numa->ranges[i - 1].start > Start; --i)
+        Numa->ranges[i] = Numa->ranges[i - 1];
+    Numa->ranges[i].start = Start;
+    Numa->ranges[i].end = End;
+    Numa->ranges[i].node = Node;
+}
+
+static void
+read_srat(struct numa_topology *Numa, const ACPI_SRAT *Srat)
+{
+    const UINT8 *Entry = (const UINT8*)(Srat + 1);
+    const UINT8 *End = (const UINT8*)Srat + Srat->Header.Length;
+
+    for (; Entry + sizeof(ACPI_SRAT_ENTRY) <= End;
+            Entry += ((const ACPI_SRAT_ENTRY*)Entry)->Length) {
+        const ACPI_SRAT_ENTRY *Header = (const void*)Entry;
+        if (!Header->Length)
+            break;
+        UINT32 Node;
+
+        switch (Header->Type) {
+        case SRAT_APIC_AFFINITY: {
+            const ACPI_SRAT_APIC_AFFINITY *Apic = (const void*)Entry;
+            if (!(Apic->Flags & SRAT_ENABLED))
+                break;
+            UINT32 Domain = Apic->ProximityDomainLow
+                | (UINT32)Apic->ProximityDomainHigh[0] << 8
+                | (UINT32)Apic->ProximityDomainHigh[1] << 16
+                | (UINT32)Apic->ProximityDomainHigh[2] << 24;
+            if ((Node = domain_node(Numa, Domain)) < Numa->n_nodes)
+                Numa->apic_nodes[Apic->ApicId] = (UINT8)Node;
+            break;
+        }
+        case SRAT_X2APIC_AFFINITY: {
+            const ACPI_SRAT_X2APIC_AFFINITY *X2Apic = (const void*)Entry;
+            if (!(X2Apic->Flags & SRAT_ENABLED)
+                    || X2Apic->X2ApicId >= MAX_APIC_IDS)
+                break;
+            if ((Node = domain_node(Numa, X2Apic->ProximityDomain))
+                    < Numa->n_nodes)
+                Numa->apic_nodes[X2Apic->X2ApicId] = (UINT8)Node;
+            break;
+        }
+        case SRAT_MEMORY_AFFINITY: {
+            const ACPI_SRAT_MEMORY_AFFINITY *Memory = (const void*)Entry;
+            if (!(Memory->Flags & SRAT_ENABLED) || !Memory->Length)
+                break;
+            if ((Node = domain_node(Numa, Memory->ProximityDomain))
+                    < Numa->n_nodes)
+                add_range(Numa, Memory->BaseAddress,
+                          Memory->BaseAddress + Memory->Length, Node);
+            break;
+        }
+        }
+    }
+}
+
+static void
+read_slit(struct numa_topology *Numa, const ACPI_SLIT *Slit)
+{
+    UINT64 N = Slit->NumberOfLocalities;
+    if (sizeof(*Slit) + N * N > Slit->Header.Length)
+        return;
+
+    /* the slit is indexed by proximity domain */
+    for (UINT32 From = 0; From < Numa->n_nodes; ++From) {
+        for (UINT32 To = 0; To < Numa->n_nodes; ++To) {
+            UINT64 i = Numa->domains[From], j = Numa->domains[To];
+            if (i < N && j < N)
+                Numa->distance[From][To] = Slit->Entries[i * N + j];
+        }
+    }
+}
+
+void
+read_numa_topology(struct numa_topology *Numa)
+{
+    Numa->n_nodes = 0;
+    Numa->n_ranges = 0;
+
+    ACPI_RSDP *Rsdp = NULL;
+    const ACPI_SDT_HEADER *Srat = NULL, *Slit = NULL;
+    if (_EFI_ERROR(LibGetSystemConfigurationTable(&Acpi20TableGuid,
+            (void**)&Rsdp)))
+        Rsdp = NULL;
+    if (Rsdp && checksum_ok(Rsdp, Rsdp->Length)) {
+        Srat = find_table(Rsdp, "SRAT");
+        Slit = find_table(Rsdp, "SLIT");
+    }
+    if (Srat)
+        read_srat(Numa, (const ACPI_SRAT*)Srat);
+
+    if (!Numa->n_nodes) {
+        /* one node, and apic_nodes is already zeroed */
+        Numa->n_nodes = 1;
+        Numa->n_ranges = 0;
+    }
+
+    for (UINT32 From = 0; From < Numa->n_nodes; ++From) {
+        for (UINT32 To = 0; To < Numa->n_nodes; ++To)
+            Numa->distance[From][To] = From == To
+                ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+    }
+    if (Slit)
+        read_slit(Numa, (const ACPI_SLIT*)Slit);
+
+    Print(L"numa: %u nodes\n", Numa->n_nodes);
+    for (UINT32 i = 0; i < Numa->n_ranges; ++i)
+        Print(L"  node %u: 0x%lx-0x%lx\n", Numa->ranges[i].node,
+              Numa->ranges[i].start, Numa->ranges[i].end);
+}
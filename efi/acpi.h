@@ -0,0 +1,99 @@
+/* this module reads the numa topology out of the acpi tables */
+#pragma once
+#include <efi.h>
+#include "util.h"
+#include "opsys/numa.h"
+
+/* acpi S5.2.5.3 */
+typedef struct {
+    char Signature[8]; /* "RSD PTR " */
+    UINT8 Checksum;
+    char OemId[6];
+    UINT8 Revision;
+    UINT32 RsdtAddress;
+    UINT32 Length;
+    UINT64 XsdtAddress;
+    UINT8 ExtendedChecksum;
+    UINT8 Reserved[3];
+} __packed ACPI_RSDP;
+
+/* acpi S5.2.6 */
+typedef struct {
+    char Signature[4];
+    UINT32 Length; /* of the whole table, including the header */
+    UINT8 Revision;
+    UINT8 Checksum;
+    char OemId[6];
+    char OemTableId[8];
+    UINT32 OemRevision;
+    UINT32 CreatorId;
+    UINT32 CreatorRevision;
+} __packed ACPI_SDT_HEADER;
+
+/* acpi S5.2.16 */
+typedef struct {
+    ACPI_SDT_HEADER Header;
+    UINT32 Reserved1;
+    UINT64 Reserved2;
+    /* followed by affinity structures */
+} __packed ACPI_SRAT;
+
+/* every affinity structure begins with these */
+typedef struct {
+    UINT8 Type;
+    UINT8 Length;
+} __packed ACPI_SRAT_ENTRY;
+
+enum {
+    SRAT_APIC_AFFINITY   = 0,
+    SRAT_MEMORY_AFFINITY = 1,
+    SRAT_X2APIC_AFFINITY = 2,
+};
+
+#define SRAT_ENABLED (1 << 0)
+
+/* acpi S5.2.16.1 */
+typedef struct {
+    ACPI_SRAT_ENTRY Entry;
+    UINT8 ProximityDomainLow;
+    UINT8 ApicId;
+    UINT32 Flags;
+    UINT8 LocalSapicEid;
+    UINT8 ProximityDomainHigh[3];
+    UINT32 ClockDomain;
+} __packed ACPI_SRAT_APIC_AFFINITY;
+
+/* acpi S5.2.16.2 */
+typedef struct {
+    ACPI_SRAT_ENTRY Entry;
+    UINT32 ProximityDomain;
+    UINT16 Reserved1;
+    UINT64 BaseAddress;
+    UINT64 Length;
+    UINT32 Reserved2;
+    UINT32 Flags;
+    UINT64 Reserved3;
+} __packed ACPI_SRAT_MEMORY_AFFINITY;
+
+/* acpi S5.2.16.3 */
+typedef struct {
+    ACPI_SRAT_ENTRY Entry;
+    UINT16 Reserved1;
+    UINT32 ProximityDomain;
+    UINT32 X2ApicId;
+    UINT32 Flags;
+    UINT32 ClockDomain;
+    UINT32 Reserved2;
+} __packed ACPI_SRAT_X2APIC_AFFINITY;
+
+/* acpi S5.2.17 */
+typedef struct {
+    ACPI_SDT_HEADER Header;
+    UINT64 NumberOfLocalities;
+    UINT8 Entries[]; /* NumberOfLocalities^2, indexed by proximity domain */
+} __packed ACPI_SLIT;
+
+/* find the srat and slit through the acpi 2.0 rsdp in the efi configuration
+ * table and fill in the topology. without an srat, the topology is one node
+ * that spans all of memory. must be called before ExitBootServices. */
+void read_numa_topology(struct numa_topology*);
@@ -11,6 +11,7 @@
 #include "opsys/bootloader_data.h"
 #include "opsys/kernel_main.h"
 #include "efivars.h"
+#include "acpi.h"
 
 static const CHAR16 *const kernel_fname = L"\\opsys";
 static EFI_FILE_HANDLE RootDir = NULL;
@@ -91,12 +92,17 @@ efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable)
     /* 1. allocate boot memory: memory that will be accessible with boot
      *    page tables */
     UINT64 new_stack = allocate_pages(1);
-    struct bootloader_data *bootloader_data = (void*)allocate_pages(2);
+    struct bootloader_data *bootloader_data =
+        (void*)allocate_pages(BOOTLOADER_DATA_PAGES);
     /* doesn't really matter how much we start out with, since they're all
      * immediately added to the free list by the os */
     bootloader_data->n_pages = 32;
     bootloader_data->free_memory =
         (void*)allocate_pages(bootloader_data->n_pages);
+    /* the acpi tables are reclaimed by the kernel, so read what it needs from
+     * them now */
+    bootloader_data->numa = (void*)allocate_pages(1);
+    read_numa_topology(bootloader_data->numa);
 
     /* 2. acquire preliminary memory map: Loader segments in this map are paged
      *    in to the boot page tables */
@@ -125,9 +131,9 @@ efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable)
     FreePool(MemoryMap);
 
     /* 5. acquire final memory map */
-    /* size of bootloader_data allocation *
-     *              V-----------V         */
-    UINT64 MMSize = 2 * PAGE_SIZE - sizeof(*bootloader_data);
+    /* the memory map fills the rest of the bootloader_data allocation */
+    UINT64 MMSize = BOOTLOADER_DATA_PAGES * PAGE_SIZE
+                    - sizeof(*bootloader_data);
     if (_EFI_ERROR(Status = uefi_call_wrapper(BS->GetMemoryMap, 5,
             &MMSize, bootloader_data->MemoryMap, &MapKey, &DescriptorSize,
             &DescriptorVersion)))
@@ -424,6 +430,9 @@ prepare_boot_page_tables(EFI_MEMORY_DESCRIPTOR *MemoryMap, UINT64 NumEntries,
             : *PaddrSize;
     }
 
+    /* the kernel maps the whole physical memory region with the largest pages
+     * it can, so keep paddr_base aligned to 1GB */
+    *PaddrSize = ALIGN_UP(*PaddrSize, p1GB);
     *PaddrBase = KERNEL_BASE - *PaddrSize;
     *MmioBase = *PaddrBase - *MmioSize;
 
@@ -462,6 +471,25 @@ prepare_boot_page_tables(EFI_MEMORY_DESCRIPTOR *MemoryMap, UINT64 NumEntries,
     bootloader_data->free_memory =
         (void*)(*PaddrBase + (UINT64)bootloader_data->free_memory);
 
+    map_page(boot_page_table, (UINT64)bootloader_data->numa,
+             *PaddrBase + (UINT64)bootloader_data->numa, PTE_RW);
+    bootloader_data->numa =
+        (void*)(*PaddrBase + (UINT64)bootloader_data->numa);
+
+    /* allocate the page frame array now that RamSize is known, and map it to
+     * the physical memory region as well */
+    bootloader_data->n_page_frames = *RamSize / PAGE_SIZE;
+    UINT64 FramePages = NUM_PAGES(0, bootloader_data->n_page_frames
+                                     * sizeof(struct page));
+    UINT64 PageFrames = allocate_pages(FramePages);
+
+    for (UINT64 i = 0; i < FramePages; ++i) {
+        UINT64 Page = PageFrames + PAGE_SIZE * i;
+        map_page(boot_page_table, Page, *PaddrBase + Page, PTE_RW);
+    }
+
+    bootloader_data->page_frames = (void*)(*PaddrBase + PageFrames);
+
     /* map kernel to high half */
     for (Elf64_Half i = 0; i < ehdr->e_phnum; ++i) {
         const Elf64_Phdr *phdr = &phdrs[i];
@@ -2,11 +2,19 @@
 #include <stdint.h>
 #include <efi.h>
 #include "elf.h"
+#include "opsys/numa.h"
+#include "opsys/page.h"
+
+/* bootloader_data and the memory map after it share this many pages */
+#define BOOTLOADER_DATA_PAGES 2
 
 struct bootloader_data {
     void *free_memory;
     uint64_t n_pages;
     uint64_t ram_size;
+    struct page *page_frames; /* indexed by pfn */
+    uint64_t n_page_frames;
+    struct numa_topology *numa; /* one page */
     uint64_t paddr_base, paddr_size;
     uint64_t mmio_base, mmio_size;
     const Elf64_Ehdr *ehdr;
@@ -0,0 +1,34 @@
+/* this file provides the numa topology that the loader reads from the acpi
+ * srat and slit */
+#pragma once
+#include <stdint.h>
+#include "opsys/virtual-memory.h"
+
+#define MAX_NUMA_NODES 8
+#define MAX_NUMA_RANGES 32
+/* xapic ids are 8 bits */
+#define MAX_APIC_IDS 256
+/* acpi S5.2.17: the distance of a node to itself */
+#define NUMA_LOCAL_DISTANCE 10
+#define NUMA_REMOTE_DISTANCE 20
+
+/* a run of physical memory on one node */
+struct numa_range {
+    uint64_t start; /* physical address */
+    uint64_t end;   /* exclusive */
+    uint32_t node;
+};
+
+/* nodes are numbered densely in the order that the srat names their proximity
+ * domains. without an srat there is one node that spans everything. */
+struct numa_topology {
+    uint32_t n_nodes;
+    uint32_t n_ranges;
+    struct numa_range ranges[MAX_NUMA_RANGES]; /* sorted by address */
+    uint32_t domains[MAX_NUMA_NODES];          /* acpi proximity domain */
+    uint8_t distance[MAX_NUMA_NODES][MAX_NUMA_NODES]; /* from the slit */
+    uint8_t apic_nodes[MAX_APIC_IDS];          /* node of each local apic */
+};
+
+_Static_assert(sizeof(struct numa_topology) <= PAGE_SIZE,
+               "struct numa_topology fits in a page");
@@ -0,0 +1,28 @@
+/* this file provides the descriptor of a physical page frame */
+#pragma once
+#include <stdint.h>
+
+/* page flags */
+enum {
+    PG_FREE      = 1 << 0, /* begins a free block of the buddy allocator */
+    PG_HEAD      = 1 << 1, /* begins an allocated block */
+    PG_SLAB      = 1 << 2, /* begins a slab. owner is the cache. */
+    PG_PAGETABLE = 1 << 3, /* holds a page table */
+    PG_PAGECACHE = 1 << 4, /* holds file data */
+    PG_RESERVED  = 1 << 5, /* never managed by the allocator */
+};
+
+/* one per page frame, indexed by pfn. the bootloader allocates the array
+ * zeroed, covering ram_size. */
+struct page {
+    uint32_t refcount; /* of an allocated block, kept in its first page */
+    uint16_t flags;
+    uint8_t order;     /* of the block begun by a PG_FREE or PG_HEAD page */
+    uint8_t app_type;  /* how an allocated block was allocated */
+    union {
+        void *owner;   /* for example the slab cache of a PG_SLAB page */
+        uint64_t private;
+    };
+};
+
+_Static_assert(sizeof(struct page) == 16, "struct page is 16 bytes");
@@ -34,6 +34,9 @@
  * the page table. */
 #define PAGE_LEVEL_INDEX(vaddr, page_level) \
     (((vaddr) >> (12 + 9 * ((page_level) - 1))) & 0x1ff)
+/* the size of the memory that one entry at the given page level maps: 4KB at
+ * level 1, 2MB at level 2 and 1GB at level 3 */
+#define PAGE_LEVEL_SIZE(page_level) (PAGE_SIZE << (9 * ((page_level) - 1)))
 
 typedef uint64_t pte_t;
 typedef pte_t page_table_t[512];
@@ -51,6 +54,8 @@ enum page_table_entry_flags {
     PTE_PS = 1 << 7, /* level 3, 2: page size */
                      /* level 4: reserved */
     PTE_G  = 1 << 8, /* global */
+    PTE_COW = 1 << 9, /* ignored by the cpu. read only until it is written,
+                       * then copied (see virtual-memory.md) */
 #define PTE_ADDR_MASK 0xfffffffff000 /* physical address to next paging level */
 #define PTE_XD (1ULL << 63) /* execute disable */
 };
@@ -17,6 +17,20 @@ noop(void)
     __asm volatile("nop");
 }
 
+static inline uint8_t
+inb(uint16_t port)
+{
+    uint8_t data;
+    __asm volatile("in %1, %0" : "=a" (data) : "d" (port));
+    return data;
+}
+
+static inline void
+outb(uint16_t port, uint8_t data)
+{
+    __asm volatile("out %0, %1" : : "a" (data), "d" (port));
+}
+
 static inline void
 stosb(void *addr, int data, size_t cnt)
 {
@@ -37,12 +51,77 @@ stosl(void *addr, int data, size_t cnt)
         "memory", "cc");
 }
 
+static inline void
+stosq(void *addr, uint64_t data, size_t cnt)
+{
+    __asm volatile(
+        "cld; rep stosq" :
+        "=D" (addr), "=c" (cnt) :
+        "0" (addr), "1" (cnt), "a" (data) :
+        "memory", "cc");
+}
+
+static inline void
+movsb(void *dst, const void *src, size_t cnt)
+{
+    __asm volatile(
+        "cld; rep movsb" :
+        "=D" (dst), "=S" (src), "=c" (cnt) :
+        "0" (dst), "1" (src), "2" (cnt) :
+        "memory", "cc");
+}
+
+static inline void
+movsq(void *dst, const void *src, size_t cnt)
+{
+    __asm volatile(
+        "cld; rep movsq" :
+        "=D" (dst), "=S" (src), "=c" (cnt) :
+        "0" (dst), "1" (src), "2" (cnt) :
+        "memory", "cc");
+}
+
 static inline void
 disable_interrupts(void)
 {
     __asm volatile("cli");
 }
 
+static inline void
+enable_interrupts(void)
+{
+    __asm volatile("sti");
+}
+
+/* x86-64-system figure 2-5 */
+#define RFLAGS_IF (1 << 9) /* interrupt enable */
+
+static inline uint64_t
+get_rflags(void)
+{
+    uint64_t rflags;
+    __asm volatile("pushfq; pop %0"
+                   : "=r"(rflags));
+    return rflags;
+}
+
+/* disable interrupts and return the rflags to give to restore_interrupts */
+static inline uint64_t
+save_interrupts(void)
+{
+    uint64_t rflags = get_rflags();
+    __asm volatile("cli" ::: "memory");
+    return rflags;
+}
+
+/* enable interrupts if they were enabled at the matching save_interrupts */
+static inline void
+restore_interrupts(uint64_t rflags)
+{
+    if (rflags & RFLAGS_IF)
+        __asm volatile("sti" ::: "memory");
+}
+
 __noreturn void halt(void);
 
 /* x86-64-system figure 2-7 */
@@ -77,10 +156,24 @@ set_cr0(uint64_t cr0)
     return cr0;
 }
 
+/* x86-64-system: cr2 stores the linear address that caused a page fault */
+static inline uint64_t
+get_cr2(void)
+{
+    uint64_t cr2;
+    __asm volatile("mov %%cr2, %0"
+                   : "=r"(cr2));
+    return cr2;
+}
+
 /* x86-64-system: cr3 stores the physical address to the 4th level paging
  * structure. the last 12 bits (which are zero because of page alignment)
  * contain flags but they don't mean anything with 4-level paging, so these bits
- * should stay zeroed. */
+ * should stay zeroed, unless CR4.PCIDE is set, in which case they are the
+ * pcid of the address space (S4.10.1). */
+#define CR3_PCID_MASK 0xfffULL
+/* when writing cr3 with CR4.PCIDE set: keep the tlb entries of the new pcid */
+#define CR3_NOFLUSH (1ULL << 63)
 static inline uint64_t
 get_cr3(void)
 {
@@ -98,6 +191,15 @@ set_cr3(uint64_t cr3)
     return cr3;
 }
 
+/* x86-64-system S4.10.4.1: invalidate the tlb entries of the page that contains
+ * vaddr, whatever its size */
+static inline void
+invlpg(uint64_t vaddr)
+{
+    __asm volatile("invlpg (%0)"
+                   :: "r"(vaddr) : "memory");
+}
+
 /* x86-64-system figure 2-7 */
 enum cr4_flags {
     CR4_VME  = 1 <<  0, /* virtual-8086 mode */
@@ -152,6 +254,15 @@ read_msr(uint32_t which_msr)
     return ((uint64_t)edx << 32) | eax;
 }
 
+static inline void
+write_msr(uint32_t which_msr, uint64_t value)
+{
+    __asm volatile(
+        "wrmsr"
+        :: "c"(which_msr), "a"((uint32_t)value),
+           "d"((uint32_t)(value >> 32)));
+}
+
 /* x86-64-msr page 2-45 */
 #define IA32_EFER 0xc0000080
 enum ia32_efer_flags {
@@ -161,6 +272,9 @@ enum ia32_efer_flags {
     EFER_NXE     = 1 << 11, /* NX bit enable */
 };
 
+/* x86-64-msr page 2-46 */
+#define IA32_GS_BASE 0xc0000101
+
 /* x86-64-msr page 2-4 */
 #define IA32_APIC_BASE 0x1b
 enum ia32_apic_base_flags {
@@ -170,6 +284,21 @@ enum ia32_apic_base_flags {
 #define APIC_BASE_MASK 0xfffffffff000
 };
 
+/* x86-64-system table 11-1: offsets of the xapic registers from the apic
+ * base */
+enum apic_register {
+    APIC_EOI      = 0x0b0, /* end of interrupt */
+    APIC_SVR      = 0x0f0, /* spurious interrupt vector */
+    APIC_ICR_LOW  = 0x300, /* interrupt command */
+    APIC_ICR_HIGH = 0x310,
+};
+
+/* x86-64-system figure 11-23 */
+#define APIC_SVR_ENABLE (1 << 8) /* apic software enable */
+/* x86-64-system figure 11-12 */
+#define APIC_ICR_PENDING (1 << 12) /* delivery status: send pending */
+#define APIC_ICR_DEST_SHIFT 24     /* of the destination in ICR_HIGH */
+
 struct cpuid {
     uint32_t a, b, c, d;
 };
@@ -188,8 +317,19 @@ cpuid(uint64_t which, struct cpuid *regs)
 enum cpuid_which {
     CPUID_BASIC   = 0x00,
     CPUID_VERSION = 0x01,
+    CPUID_EXTENDED_FEATURES = 0x07, /* subleaf 0 */
+/* too large for an enum */
+#define CPUID_EXTENDED_BASIC   0x80000000U
+#define CPUID_EXTENDED_VERSION 0x80000001U
 };
 
+/* x86-64-instruction table 3-8 */
+#define CPUID_1_EDX_SSE2 (1U << 26) /* includes movnti */
+#define CPUID_1_ECX_PCID (1U << 17) /* process-context identifiers */
+#define CPUID_7_EBX_ERMS (1U << 9)  /* enhanced rep movsb/stosb */
+#define CPUID_80000001_EDX_NX (1U << 20) /* execute disable */
+#define CPUID_80000001_EDX_PAGE1GB (1U << 26) /* 1GB pages */
+
 /* x86-64-system S3.4.5 */
 /* size of the segment */
 #define SEGDESC_GET_LIMIT(d) \
@@ -322,6 +462,15 @@ enum exception_number {
     ((num) == EXC_DF || (num) == EXC_TS || (num) == EXC_NP || \
      (num) == EXC_SS || (num) == EXC_GP || (num) == EXC_PF || (num) == EXC_AC)
 
+/* x86-64-system figure 4-12 */
+enum page_fault_error {
+    PFE_P    = 1 << 0, /* protection violation, else the page is not present */
+    PFE_W    = 1 << 1, /* write */
+    PFE_U    = 1 << 2, /* user mode */
+    PFE_RSVD = 1 << 3, /* reserved bit set in a paging-structure entry */
+    PFE_I    = 1 << 4, /* instruction fetch */
+};
+
 /* registers in the order of pushaq */
 struct x86_64_registers {
     uint64_t rdi;
@@ -13,6 +13,8 @@
 #define __section(sec) __attribute__((section(sec)))
 #define __ro_after_init __section(".data.rel.ro")
 #define IN_RANGE(base, size, x) ((base) <= (x) && (x) < (base) + (size))
+/* round x up to a multiple of align, which is a power of two */
+#define ALIGN_UP(x, align) (((x) + (align) - 1) & ~((align) - 1))
 #define HANG() do {} while (1)
 
 void __builtin_unreachable(void);
@@ -6,7 +6,13 @@
 #include "opsys/kernel_main.h"
 #include "opsys/virtual-memory.h"
 #include "util.h"
+#include "huge-pages.h"
+#include "kmalloc.h"
+#include "numa.h"
+#include "page-ops.h"
+#include "serial.h"
 #include "virtual-memory.h"
+#include "vm-area.h"
 #include "stubs.h"
 #include "x86.h"
 
@@ -25,11 +31,19 @@ void kernel_main(struct bootloader_data *bootloader_data_in)
     bootloader_data = bootloader_data_in;
 
     init_cpu();
+    init_page_ops();
+    init_virtual_memory();
+    init_serial();
 
     /* start off with some initial memory */
-    for (uint64_t i = 0; i < bootloader_data->n_pages; ++i)
-        free_physical_page((void*)((uint64_t)bootloader_data->free_memory
-                                             + PAGE_SIZE * i));
+    init_memory_map();
+    init_numa();
+    init_page_frames();
+    free_physical_range(
+        VADDR_TO_PADDR(bootloader_data->free_memory),
+        bootloader_data->n_pages);
+    init_kmalloc();
+    init_vm_areas();
 
     void *new_stack;
     if (!(new_stack = allocate_physical_page(APP_NORMAL)))
@@ -41,8 +55,26 @@ void kernel_main(struct bootloader_data *bootloader_data_in)
 
 void main2(void)
 {
-    page_table_t *kernel_address_space = new_address_space();
-    set_cr3((uint64_t)kernel_address_space - bootloader_data->paddr_base);
+    page_table_t *address_space;
+    if (!(address_space = new_kernel_address_space()))
+        halt(); /* nomem */
+    load_address_space(address_space);
+    /* the rest of physical memory is mapped from now on */
+    kernel_address_space = address_space;
+    enable_apic();
+    /* the boot page tables and the rest of the loader are unused now */
+    reclaim_loader_memory();
+    if (!share_kernel_half())
+        halt(); /* nomem */
+    init_huge_pages();
+    /* the kernel has no idle loop yet, so the end of boot is the only idle
+     * time for the shrinkers and the zero pool */
+    balance_physical_memory();
+    while (zero_idle_page())
+        ;
+#ifdef _KERNEL_DEBUG
+    dump_physical_memory(serial_write);
+#endif
     interrupt(40);
     int3();
     BREAK();
@@ -0,0 +1,171 @@
+/* this module provides pools of reserved 2MB and 1GB pages. huge pages are
+ * reserved from the page allocator at boot, before memory has a chance to
+ * fragment, and kept out of it until they are freed past the reservation. */
+#include <stdbool.h>
+#include <stdint.h>
+#include "string.h"
+#include "opsys/bootloader_data.h"
+#include "opsys/virtual-memory.h"
+#include "opsys/x86.h"
+#include "huge-pages.h"
+#include "list.h"
+#include "page-ops.h"
+#include "physical-memory.h"
+#include "spinlock.h"
+
+/* the pages of each size reserved at boot, set with make HUGE_PAGES_2M=n and
+ * HUGE_PAGES_1G=n. nothing is taken from the page allocator by default. */
+#ifndef HUGE_PAGES_2M
+#define HUGE_PAGES_2M 0
+#endif
+#ifndef HUGE_PAGES_1G
+#define HUGE_PAGES_1G 0
+#endif
+
+struct huge_page_pool {
+    struct spinlock lock;
+    unsigned order;
+    /* free pages are linked in through a list_node in their first bytes */
+    struct list_node free_list;
+    struct huge_page_stats stats;
+};
+
+static struct huge_page_pool pools[N_HUGE_PAGE_SIZES] = {
+    [HUGE_PAGE_2M] = { .lock = SPINLOCK_INIT, .order = HUGE_PAGE_2M_ORDER },
+    [HUGE_PAGE_1G] = { .lock = SPINLOCK_INIT, .order = HUGE_PAGE_1G_ORDER },
+};
+
+static uint64_t
+lock_pool(struct huge_page_pool *pool)
+{
+    uint64_t rflags = save_interrupts();
+    spin_lock(&pool->lock);
+    return rflags;
+}
+
+static void
+unlock_pool(struct huge_page_pool *pool, uint64_t rflags)
+{
+    spin_unlock(&pool->lock);
+    restore_interrupts(rflags);
+}
+
+void
+init_huge_pages(void)
+{
+    for (unsigned size = 0; size < N_HUGE_PAGE_SIZES; ++size)
+        list_init(&pools[size].free_list);
+    /* 1GB pages first so that the 2MB pages don't break them up */
+    set_huge_page_reservation(HUGE_PAGE_1G, HUGE_PAGES_1G);
+    set_huge_page_reservation(HUGE_PAGE_2M, HUGE_PAGES_2M);
+}
+
+bool
+set_huge_page_reservation(enum huge_page_size size, uint64_t n_pages)
+{
+    struct huge_page_pool *pool = &pools[size];
+    uint64_t rflags = lock_pool(pool);
+    pool->stats.n_reserved = n_pages;
+    /* pages that are in use come back to the pool when they are freed */
+    struct list_node surplus;
+    list_init(&surplus);
+    while (pool->stats.n_free > n_pages) {
+        struct list_node *page = pool->free_list.next;
+        list_remove(page);
+        list_push(&surplus, page);
+        --pool->stats.n_free;
+    }
+    uint64_t n_wanted = n_pages - pool->stats.n_free;
+    unlock_pool(pool, rflags);
+
+    while (!list_empty(&surplus)) {
+        struct list_node *page = surplus.next;
+        list_remove(page);
+        free_physical_pages(page, pool->order);
+    }
+
+    /* allocated outside of the lock, since the allocator may run shrinkers */
+    for (; n_wanted; --n_wanted) {
+        void *page;
+        if (!(page = allocate_physical_pages(pool->order, APP_NORMAL)))
+            break;
+        rflags = lock_pool(pool);
+        list_push(&pool->free_list, page);
+        ++pool->stats.n_free;
+        unlock_pool(pool, rflags);
+    }
+
+    return !n_wanted;
+}
+
+void*
+allocate_huge_page(enum huge_page_size size, enum app_flags flags)
+{
+    struct huge_page_pool *pool = &pools[size];
+    uint64_t rflags = lock_pool(pool);
+    struct list_node *page = NULL;
+    ++pool->stats.allocs;
+    if (!list_empty(&pool->free_list)) {
+        page = pool->free_list.next;
+        list_remove(page);
+        --pool->stats.n_free;
+    } else {
+        ++pool->stats.fallbacks;
+    }
+    unlock_pool(pool, rflags);
+
+    if (!page) {
+        void *pages;
+        if (!(pages = allocate_physical_pages(pool->order, flags))) {
+            rflags = lock_pool(pool);
+            ++pool->stats.failures;
+            unlock_pool(pool, rflags);
+        }
+        return pages;
+    }
+
+    reset_physical_pages(page, flags);
+    if (flags & APP_PTE)
+        flags |= APP_ZERO | APP_FLAT;
+    if (flags & APP_ZERO) {
+        for (uint64_t i = 0; i < ORDER_PAGES(pool->order); ++i)
+            clear_page((char*)page + i * PAGE_SIZE);
+    } else {
+        /* don't leak the pool's links */
+        memset(page, 0, sizeof(*page));
+    }
+    if (flags & APP_FLAT)
+        return (void*)VADDR_TO_PADDR(page);
+    return page;
+}
+
+void
+free_huge_page(void *page, enum huge_page_size size)
+{
+    struct huge_page_pool *pool = &pools[size];
+    if (VADDR_TO_PFN(page) & (ORDER_PAGES(pool->order) - 1))
+        halt(); /* assert */
+    /* a pool page is owned by the pool, not by its last user */
+    reset_physical_pages(page, APP_NORMAL);
+    uint64_t rflags = lock_pool(pool);
+    ++pool->stats.frees;
+    /* refill the reservation before giving pages back to the allocator */
+    bool wanted = pool->stats.n_free < pool->stats.n_reserved;
+    if (wanted) {
+        list_push(&pool->free_list, page);
+        ++pool->stats.n_free;
+    }
+    unlock_pool(pool, rflags);
+
+    if (!wanted)
+        free_physical_pages(page, pool->order);
+}
+
+void
+get_huge_page_stats(enum huge_page_size size, struct huge_page_stats *stats)
+{
+    struct huge_page_pool *pool = &pools[size];
+    uint64_t rflags = lock_pool(pool);
+    *stats = pool->stats;
+    unlock_pool(pool, rflags);
+}
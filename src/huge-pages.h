@@ -0,0 +1,45 @@
+/* this module provides pools of reserved 2MB and 1GB pages */
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include "util.h"
+#include "physical-memory.h"
+
+enum huge_page_size {
+    HUGE_PAGE_2M,
+    HUGE_PAGE_1G,
+    N_HUGE_PAGE_SIZES,
+};
+
+/* the buddy order of each huge page size */
+#define HUGE_PAGE_2M_ORDER 9
+#define HUGE_PAGE_1G_ORDER 18
+
+struct huge_page_stats {
+    uint64_t n_reserved; /* pages the pool is meant to keep */
+    uint64_t n_free;     /* pages in the pool right now */
+    uint64_t allocs;
+    uint64_t frees;
+    /* allocations that found the pool empty and went to the page allocator */
+    uint64_t fallbacks;
+    /* allocations that the page allocator couldn't serve either */
+    uint64_t failures;
+};
+
+/* reserve the huge pages that the kernel was built with (HUGE_PAGES_2M and
+ * HUGE_PAGES_1G, none by default). called once the kernel address space is
+ * loaded, so that all of memory is mapped. */
+void init_huge_pages(void);
+
+/* keep n_pages pages of the given size in the pool. more are allocated right
+ * away, and surplus free pages go back to the page allocator. returns false
+ * if out of memory before the pool has n_pages free pages. */
+bool set_huge_page_reservation(enum huge_page_size, uint64_t n_pages);
+
+/* allocate a page of the given size, aligned to its size. flags are as for
+ * allocate_physical_pages. returns NULL if out of memory. */
+__malloc void* allocate_huge_page(enum huge_page_size, enum app_flags);
+/* free a page that originated from allocate_huge_page with the same size */
+void free_huge_page(void *page, enum huge_page_size);
+
+void get_huge_page_stats(enum huge_page_size, struct huge_page_stats*);
@@ -4,6 +4,9 @@
 #include "util.h"
 #include "interrupts.h"
 #include "gdt.h"
+#include "shootdown.h"
+#include "virtual-memory.h"
+#include "x86.h"
 
 /* 
  * it has global linkage so the stub can pass in the magic.
@@ -22,6 +25,15 @@ interrupt_handler(struct interrupt_frame *frame, uint64_t magic)
     switch (frame->interrupt_number) {
     case EXC_BP:
         return;
+    case EXC_PF:
+        handle_page_fault(frame);
+        return;
+    case IPI_TLB_SHOOTDOWN:
+        handle_tlb_shootdown();
+        return;
+    case APIC_SPURIOUS_VECTOR:
+        /* not to be acknowledged */
+        return;
     default:
         BREAK();
         break;
@@ -0,0 +1,16 @@
+/* this file contains overrides to have readelf work in the kernel */
+#include "readelf.h"
+#include "elf.h"
+#include "kmalloc.h"
+
+void*
+elf_alloc(Elf64_Xword size)
+{
+    return kmalloc(size);
+}
+
+void
+elf_free(const void *ptr)
+{
+    kfree(ptr);
+}
@@ -0,0 +1,112 @@
+/* this module provides variable-size kernel memory allocation. sizes up to
+ * KMALLOC_MAX_SIZE are rounded up to a power of two and served by a slab cache
+ * per size class. larger sizes get their own block of pages. */
+#include <stddef.h>
+#include <stdint.h>
+#include "opsys/virtual-memory.h"
+#include "opsys/x86.h"
+#include "util.h"
+#include "kmalloc.h"
+#include "physical-memory.h"
+#include "slab.h"
+
+#define KMALLOC_MIN_SHIFT 4  /* 16 bytes */
+#define KMALLOC_MAX_SHIFT 13 /* 8KB */
+#define KMALLOC_MAX_SIZE (1ULL << KMALLOC_MAX_SHIFT)
+
+static const char *const kmalloc_names[] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128", "kmalloc-256",
+    "kmalloc-512", "kmalloc-1k", "kmalloc-2k", "kmalloc-4k", "kmalloc-8k",
+};
+
+static struct kmem_cache *kmalloc_caches[ARRAY_LENGTH(kmalloc_names)];
+
+void
+init_kmalloc(void)
+{
+    for (unsigned i = 0; i < ARRAY_LENGTH(kmalloc_caches); ++i) {
+        size_t size = 1ULL << (KMALLOC_MIN_SHIFT + i);
+        if (!(kmalloc_caches[i] =
+                kmem_cache_create(kmalloc_names[i], size, 0, NULL)))
+            halt(); /* nomem */
+    }
+}
+
+/* log2 of the power of two that size rounds up to */
+static unsigned
+size_shift(size_t size)
+{
+    if (size <= 1)
+        return 0;
+    return 64 - (unsigned)__builtin_clzll(size - 1);
+}
+
+void*
+kmalloc(size_t size)
+{
+    if (!size)
+        return NULL;
+
+    if (size <= KMALLOC_MAX_SIZE) {
+        unsigned shift = size_shift(size);
+        if (shift < KMALLOC_MIN_SHIFT)
+            shift = KMALLOC_MIN_SHIFT;
+        return kmem_cache_alloc(kmalloc_caches[shift - KMALLOC_MIN_SHIFT]);
+    }
+
+    unsigned order = size_shift(NUM_PAGES(0, size));
+    return allocate_physical_pages(order, APP_NORMAL);
+}
+
+/* the number of usable bytes at ptr. *cache is set to the slab cache of ptr,
+ * or NULL if it is a block of pages. */
+static size_t
+allocation_size(const void *ptr, struct kmem_cache **cache)
+{
+    unsigned order;
+    void *head;
+    if (!(head = physical_block_head(ptr, &order)))
+        halt(); /* assert */
+
+    if (!(*cache = kmem_slab_cache(head))) {
+        if (head != ptr)
+            halt(); /* assert */
+        return ORDER_SIZE(order);
+    }
+    return kmem_cache_size(*cache);
+}
+
+void
+kfree(const void *ptr)
+{
+    if (!ptr)
+        return;
+    struct kmem_cache *cache;
+    size_t size = allocation_size(ptr, &cache);
+    if (cache)
+        kmem_cache_free(cache, (void*)ptr);
+    else
+        free_physical_pages((void*)ptr, size_shift(size / PAGE_SIZE));
+}
+
+void*
+krealloc(void *ptr, size_t size)
+{
+    if (!ptr)
+        return kmalloc(size);
+    if (!size) {
+        kfree(ptr);
+        return NULL;
+    }
+
+    struct kmem_cache *cache;
+    size_t old_size = allocation_size(ptr, &cache);
+    if (size <= old_size)
+        return ptr;
+    void *new_ptr;
+    if (!(new_ptr = kmalloc(size)))
+        return NULL;
+    memcpy(new_ptr, ptr, old_size);
+    kfree(ptr);
+    return new_ptr;
+}
@@ -0,0 +1,15 @@
+/* this module provides variable-size kernel memory allocation */
+#pragma once
+#include <stddef.h>
+#include "util.h"
+
+/* create the size class caches */
+void init_kmalloc(void);
+
+/* allocate size uninitialized bytes. returns NULL if out of memory. */
+__malloc void* kmalloc(size_t size);
+/* free a pointer that originated from kmalloc or krealloc. ptr may be NULL. */
+void kfree(const void *ptr);
+/* resize the allocation at ptr, moving it if it doesn't fit. ptr may be NULL.
+ * returns NULL and leaves ptr allocated if out of memory. */
+void* krealloc(void *ptr, size_t size);
@@ -0,0 +1,42 @@
+/* this module provides intrusive circular doubly linked lists. a list is a
+ * sentinel node that is its own next and prev when the list is empty. */
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+
+struct list_node {
+    struct list_node *next, *prev;
+};
+
+/* the struct that contains the given node as member */
+#define LIST_ENTRY(node, type, member) \
+    ((type*)((char*)(node) - offsetof(type, member)))
+
+static inline void
+list_init(struct list_node *head)
+{
+    head->next = head->prev = head;
+}
+
+static inline bool
+list_empty(const struct list_node *head)
+{
+    return head->next == head;
+}
+
+/* insert node at the front of the list */
+static inline void
+list_push(struct list_node *head, struct list_node *node)
+{
+    node->next = head->next;
+    node->prev = head;
+    head->next->prev = node;
+    head->next = node;
+}
+
+static inline void
+list_remove(struct list_node *node)
+{
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+}
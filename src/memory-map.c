@@ -0,0 +1,115 @@
+/* this module provides an index of the efi memory map: its entries sorted by
+ * address and merged into regions, so that the region of an address can be
+ * found with a binary search, and linked by type, so that the regions of one
+ * type can be visited without scanning the others. */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "opsys/bootloader_data.h"
+#include "opsys/virtual-memory.h"
+#include "opsys/x86.h"
+#include "memory-map.h"
+#include "util.h"
+
+/* the memory map shares the pages of bootloader_data, so it has fewer entries
+ * than this */
+#define MAX_MEMORY_REGIONS \
+    (BOOTLOADER_DATA_PAGES * PAGE_SIZE / sizeof(EFI_MEMORY_DESCRIPTOR))
+
+static struct memory_region regions[MAX_MEMORY_REGIONS];
+static size_t n_regions = 0;
+/* the first region of each type, or -1 */
+static int32_t first_of_type[EfiMaxMemoryType];
+
+static void
+insert_region(const EFI_MEMORY_DESCRIPTOR *Memory)
+{
+    struct memory_region region = {
+        .start = Memory->PhysicalStart,
+        .end = Memory->PhysicalStart + Memory->NumberOfPages * PAGE_SIZE,
+        .virt = Memory->VirtualStart,
+        .attribute = Memory->Attribute,
+        .type = Memory->Type,
+        .next_of_type = -1,
+    };
+
+    /* insertion sort. the firmware's map is almost always sorted already. */
+    size_t i = n_regions++;
+    for (; i && regions[i - 1].start > region.start; --i)
+        regions[i] = regions[i - 1];
+    regions[i] = region;
+}
+
+/* whether b continues a, physically and, if they are mapped, virtually */
+static bool
+can_merge(const struct memory_region *a, const struct memory_region *b)
+{
+    return a->type == b->type
+        && a->attribute == b->attribute
+        && a->end == b->start
+        && (a->virt ? a->virt + (a->end - a->start) == b->virt : !b->virt);
+}
+
+void
+init_memory_map(void)
+{
+    if (bootloader_data->NumEntries > MAX_MEMORY_REGIONS)
+        halt(); /* assert */
+    for (UINT64 i = 0; i < bootloader_data->NumEntries; ++i)
+        insert_region(&bootloader_data->MemoryMap[i]);
+
+    size_t n_merged = 0;
+    for (size_t i = 0; i < n_regions; ++i) {
+        if (n_merged && can_merge(&regions[n_merged - 1], &regions[i]))
+            regions[n_merged - 1].end = regions[i].end;
+        else
+            regions[n_merged++] = regions[i];
+    }
+    n_regions = n_merged;
+
+    /* link the regions of each type, back to front so that each list is in
+     * order of address */
+    for (size_t type = 0; type < ARRAY_LENGTH(first_of_type); ++type)
+        first_of_type[type] = -1;
+    for (size_t i = n_regions; i--;) {
+        struct memory_region *region = &regions[i];
+        if (region->type >= EfiMaxMemoryType)
+            continue;
+        region->next_of_type = first_of_type[region->type];
+        first_of_type[region->type] = (int32_t)i;
+    }
+}
+
+const struct memory_region*
+find_memory_region(uint64_t paddr)
+{
+    /* the last region that starts at or before paddr */
+    size_t low = 0, high = n_regions;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (regions[mid].start <= paddr)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    if (!low || paddr >= regions[low - 1].end)
+        return NULL;
+    return &regions[low - 1];
+}
+
+const struct memory_region*
+next_memory_region(const struct memory_region *region, uint32_t type)
+{
+    if (type >= EfiMaxMemoryType)
+        return NULL;
+    int32_t i = region ? region->next_of_type : first_of_type[type];
+    return i < 0 ? NULL : &regions[i];
+}
+
+const struct memory_region*
+memory_regions(size_t *n)
+{
+    *n = n_regions;
+    return regions;
+}
@@ -0,0 +1,36 @@
+/* this module provides an index of the efi memory map */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <efi.h>
+
+/* a run of physical memory of one type. runs of the same type and attributes
+ * that touch are merged into one region. */
+struct memory_region {
+    uint64_t start;     /* physical address */
+    uint64_t end;       /* exclusive */
+    uint64_t virt;      /* VirtualStart of runtime and mmio regions */
+    uint64_t attribute; /* EFI_MEMORY_ flags */
+    uint32_t type;      /* EFI_MEMORY_TYPE */
+    /* index of the next region of the same type, or -1 */
+    int32_t next_of_type;
+};
+
+/* sort and merge the final memory map from bootloader_data */
+void init_memory_map(void);
+
+/* the region that contains the physical address, or NULL if there is none */
+const struct memory_region* find_memory_region(uint64_t paddr);
+
+/* the regions of the given type in order of address. pass NULL to get the
+ * first one. returns NULL after the last one. */
+const struct memory_region* next_memory_region(const struct memory_region*,
+                                               uint32_t type);
+
+/* every region in order of address */
+const struct memory_region* memory_regions(size_t *n_regions);
+
+#define for_each_memory_region(region, type) \
+    for (const struct memory_region *region = next_memory_region(NULL, type); \
+            region; \
+            region = next_memory_region(region, type))
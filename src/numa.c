@@ -0,0 +1,77 @@
+/* this module provides the numa topology of the machine, as read by the loader
+ * from the acpi srat and slit */
+#include <stdint.h>
+#include "opsys/bootloader_data.h"
+#include "opsys/numa.h"
+#include "numa.h"
+
+/* each node's nodes from nearest to farthest */
+static uint8_t fallbacks[MAX_NUMA_NODES][MAX_NUMA_NODES];
+
+/* a node is nearest to itself, even if the slit says otherwise */
+static unsigned
+fallback_key(const struct numa_topology *numa, unsigned from, unsigned to)
+{
+    return from == to ? 0 : numa->distance[from][to];
+}
+
+void
+init_numa(void)
+{
+    const struct numa_topology *numa = bootloader_data->numa;
+
+    for (unsigned node = 0; node < numa->n_nodes; ++node) {
+        uint8_t *fallback = fallbacks[node];
+        /* insertion sort. ties keep the order of the nodes. */
+        for (unsigned i = 0; i < numa->n_nodes; ++i) {
+            unsigned j = i;
+            for (; j && fallback_key(numa, node, fallback[j - 1])
+                        > fallback_key(numa, node, i); --j)
+                fallback[j] = fallback[j - 1];
+            fallback[j] = (uint8_t)i;
+        }
+    }
+}
+
+unsigned
+numa_n_nodes(void)
+{
+    return bootloader_data->numa->n_nodes;
+}
+
+unsigned
+paddr_node(uint64_t paddr, uint64_t *start, uint64_t *end)
+{
+    const struct numa_topology *numa = bootloader_data->numa;
+    *start = 0;
+    *end = UINT64_MAX;
+
+    /* the ranges are sorted and there are only a few of them */
+    for (uint32_t i = 0; i < numa->n_ranges; ++i) {
+        const struct numa_range *range = &numa->ranges[i];
+        if (paddr < range->start) {
+            *end = range->start;
+            break;
+        }
+        if (paddr < range->end) {
+            *start = range->start;
+            *end = range->end;
+            return range->node;
+        }
+        *start = range->end;
+    }
+
+    return 0;
+}
+
+unsigned
+apic_node(uint8_t apic_id)
+{
+    return bootloader_data->numa->apic_nodes[apic_id];
+}
+
+const uint8_t*
+node_fallback(unsigned node)
+{
+    return fallbacks[node];
+}
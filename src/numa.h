@@ -0,0 +1,22 @@
+/* this module provides the numa topology of the machine */
+#pragma once
+#include <stdint.h>
+#include "opsys/numa.h"
+
+/* sort each node's fallback order from the distances the loader found. until
+ * this is called, every node falls back to node 0 only. */
+void init_numa(void);
+
+unsigned numa_n_nodes(void);
+
+/* the node of the memory at paddr. [*start, *end) is set to the run of memory
+ * around paddr that is on the same node. memory that the srat doesn't mention
+ * is on node 0. */
+unsigned paddr_node(uint64_t paddr, uint64_t *start, uint64_t *end);
+
+/* the node of the cpu with the given local apic id */
+unsigned apic_node(uint8_t apic_id);
+
+/* the nodes in order of distance from the given node, starting with itself.
+ * numa_n_nodes long. */
+const uint8_t* node_fallback(unsigned node);
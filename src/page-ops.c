@@ -0,0 +1,132 @@
+/* this module provides whole-page clear and copy routines in a few variants,
+ * chosen by cpuid at boot */
+#include <stddef.h>
+#include <stdint.h>
+#include "opsys/virtual-memory.h"
+#include "opsys/x86.h"
+#include "util.h"
+#include "page-ops.h"
+
+#define PAGE_WORDS (PAGE_SIZE / sizeof(uint64_t))
+
+typedef void clear_page_t(void*);
+typedef void copy_page_t(void*, const void*);
+
+/* enhanced rep movsb/stosb: microcode moves whole cache lines at a time */
+static void
+clear_page_erms(void *page)
+{
+    stosb(page, 0, PAGE_SIZE);
+}
+
+static void
+copy_page_erms(void *dst, const void *src)
+{
+    movsb(dst, src, PAGE_SIZE);
+}
+
+/* without erms, quadwords are the fastest string operations */
+static void
+clear_page_stosq(void *page)
+{
+    stosq(page, 0, PAGE_WORDS);
+}
+
+static void
+copy_page_movsq(void *dst, const void *src)
+{
+    movsq(dst, src, PAGE_WORDS);
+}
+
+/* movnti writes around the cache. sfence orders the weakly ordered stores
+ * before any store that publishes the page. */
+static void
+clear_page_movnti(void *page)
+{
+    uint64_t *words = page;
+
+    for (size_t i = 0; i < PAGE_WORDS; i += 4) {
+        __asm volatile(
+            "movnti %1, 0(%0)\n\t"
+            "movnti %1, 8(%0)\n\t"
+            "movnti %1, 16(%0)\n\t"
+            "movnti %1, 24(%0)"
+            :: "r"(&words[i]), "r"(0ULL)
+            : "memory");
+    }
+
+    __asm volatile("sfence" ::: "memory");
+}
+
+static void
+copy_page_movnti(void *dst, const void *src)
+{
+    uint64_t *dst_words = dst;
+    const uint64_t *src_words = src;
+
+    for (size_t i = 0; i < PAGE_WORDS; i += 4) {
+        __asm volatile(
+            "movnti %1, 0(%0)\n\t"
+            "movnti %2, 8(%0)\n\t"
+            "movnti %3, 16(%0)\n\t"
+            "movnti %4, 24(%0)"
+            :: "r"(&dst_words[i]), "r"(src_words[i]), "r"(src_words[i + 1]),
+               "r"(src_words[i + 2]), "r"(src_words[i + 3])
+            : "memory");
+    }
+
+    __asm volatile("sfence" ::: "memory");
+}
+
+/* the baseline until init_page_ops runs */
+static clear_page_t *clear_page_impl = clear_page_stosq;
+static copy_page_t *copy_page_impl = copy_page_movsq;
+static clear_page_t *clear_page_nocache_impl = clear_page_stosq;
+static copy_page_t *copy_page_nocache_impl = copy_page_movsq;
+
+void
+init_page_ops(void)
+{
+    struct cpuid basic, version, features = { 0 };
+    cpuid(CPUID_BASIC, &basic);
+    cpuid(CPUID_VERSION, &version);
+    if (basic.a >= CPUID_EXTENDED_FEATURES)
+        cpuid(CPUID_EXTENDED_FEATURES, &features);
+
+    if (features.b & CPUID_7_EBX_ERMS) {
+        clear_page_impl = clear_page_erms;
+        copy_page_impl = copy_page_erms;
+    }
+
+    if (version.d & CPUID_1_EDX_SSE2) {
+        clear_page_nocache_impl = clear_page_movnti;
+        copy_page_nocache_impl = copy_page_movnti;
+    } else {
+        clear_page_nocache_impl = clear_page_impl;
+        copy_page_nocache_impl = copy_page_impl;
+    }
+}
+
+void
+clear_page(void *page)
+{
+    clear_page_impl(page);
+}
+
+void
+copy_page(void *dst, const void *src)
+{
+    copy_page_impl(dst, src);
+}
+
+void
+clear_page_nocache(void *page)
+{
+    clear_page_nocache_impl(page);
+}
+
+void
+copy_page_nocache(void *dst, const void *src)
+{
+    copy_page_nocache_impl(dst, src);
+}
@@ -0,0 +1,14 @@
+/* this module provides whole-page clear and copy routines */
+#pragma once
+
+/* choose the fastest variants that the cpu supports */
+void init_page_ops(void);
+
+/* for pages that are about to be used: the page stays in the cache */
+void clear_page(void *page);
+void copy_page(void *dst, const void *src);
+
+/* for pages that won't be touched soon: non-temporal stores bypass the cache so
+ * that the working set isn't evicted */
+void clear_page_nocache(void *page);
+void copy_page_nocache(void *dst, const void *src);
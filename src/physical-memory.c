@@ -0,0 +1,1231 @@
+/* this module provides the physical page allocator: a binary buddy allocator
+ * over zones of physically contiguous memory */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "string.h"
+#include "opsys/virtual-memory.h"
+#include "opsys/bootloader_data.h"
+#include "opsys/x86.h"
+#include "list.h"
+#include "memory-map.h"
+#include "numa.h"
+#include "page-ops.h"
+#include "physical-memory.h"
+#include "spinlock.h"
+#include "virtual-memory.h"
+#include "x86.h"
+
+/* the state of a page in a zone is kept in its struct page: the first page of
+ * a free block is PG_FREE and the first page of an allocated block is PG_HEAD,
+ * with the order of the block. any other page is inside a block. */
+#define BLOCK_FLAGS (PG_FREE | PG_HEAD)
+
+/* zones never span more than one numa node */
+struct zone {
+    uint64_t base_pfn; /* first page frame number of the zone */
+    uint64_t n_pages;
+    unsigned node;
+    uint64_t n_free;   /* number of free pages */
+    uint64_t n_free_blocks[MAX_ORDER + 1];
+    /* free blocks are linked in through a list_node in their first bytes */
+    struct list_node free_lists[MAX_ORDER + 1];
+};
+
+#define MAX_ZONES 64
+static struct zone zones[MAX_ZONES];
+static unsigned n_zones = 0;
+/* the zones in order of base_pfn, for find_zone. the zones themselves can't
+ * move, since their free lists point back at them. */
+static uint8_t zones_by_pfn[MAX_ZONES];
+/* freed once every zone was taken, and next to none of them */
+static uint64_t n_dropped_pages = 0;
+static uint64_t n_zone_pages = 0; /* managed by the zones */
+static uint64_t n_free_pages = 0;
+static uint64_t peak_used_pages = 0;
+/* protects the zones and the page counts */
+static struct spinlock zone_lock = SPINLOCK_INIT;
+
+/* per-cpu caches of single pages in front of the zones, so that most page
+ * traffic never takes zone_lock. an empty magazine is refilled and a full one
+ * is drained MAGAZINE_BATCH pages at a time. */
+#define MAGAZINE_SIZE 64
+#define MAGAZINE_BATCH 32
+struct page_magazine {
+    unsigned n_pages;
+    void *pages[MAGAZINE_SIZE];
+    struct page_magazine_stats stats;
+    /* allocator counters are kept per cpu along with the magazine */
+    uint64_t allocs[N_APP_TYPES];
+    uint64_t frees[N_APP_TYPES];
+    uint64_t failures;
+} __aligned(64); /* keep each cpu's magazine on its own cache lines */
+
+static struct page_magazine magazines[MAX_CPUS];
+
+/* pages that are already zeroed, so that APP_ZERO allocations don't zero on the
+ * critical path. while the pool is below ZERO_POOL_TARGET, freed pages go to
+ * the dirty list instead of the magazines, and zero_idle_page zeroes dirty
+ * pages (or fresh ones) into the clean list. the kernel has no idle loop yet,
+ * so that only happens at the end of boot. afterwards APP_ZERO allocations
+ * zero dirty pages themselves once the clean list is empty, so that the dirty
+ * list never holds pages back. both lists are linked through the first word
+ * of each page, which is cleared again when a clean page is handed out. */
+#define ZERO_POOL_TARGET 256
+struct pool_page {
+    struct pool_page *next;
+};
+
+static struct {
+    struct spinlock lock;
+    struct pool_page *clean, *dirty;
+    uint64_t n_clean, n_dirty;
+} zero_pool = { .lock = SPINLOCK_INIT };
+
+/* memory beyond free_memory is added to the zones from the memory map lazily,
+ * a chunk of up to GROW_ORDER at a time, so that boot doesn't have to free all
+ * of memory up front. each numa node grows into its own memory: pmem_regions
+ * is the EfiConventionalMemory region of its last chunk and pmem_tails is the
+ * physical address where its next chunk starts. */
+#define GROW_ORDER 9
+/* grow before the free pages run out so that allocations rarely wait on it */
+#define GROW_RESERVE 16
+static const struct memory_region *pmem_regions[MAX_NUMA_NODES];
+static uint64_t pmem_tails[MAX_NUMA_NODES];
+/* protects the pmem_ variables. grow_cpu is the index of the cpu that holds it,
+ * so that an allocation from an interrupt in the middle of growing doesn't
+ * grow again. */
+static struct spinlock grow_lock = SPINLOCK_INIT;
+static int grow_cpu = -1;
+/* EfiConventionalMemory below physical_memory_limit that is not in the zones
+ * yet */
+static uint64_t n_pending_pages = 0;
+
+/* the default min watermark is 1/WATERMARK_SHARE of memory, but at least
+ * WATERMARK_MIN_PAGES. low and high are 5/4 and 3/2 of min. */
+#define WATERMARK_SHARE 256
+#define WATERMARK_MIN_PAGES 32
+static struct physical_memory_watermarks watermarks;
+/* set when an allocation goes below the low watermark, and cleared once frees
+ * or balance_physical_memory bring memory back above the high watermark */
+static bool memory_pressure = false;
+
+static shrinker_t shrink_zero_pool;
+static shrinker_t *shrinkers[MAX_SHRINKERS] = { shrink_zero_pool };
+static unsigned n_shrinkers = 1;
+/* protects registration. the shrinkers themselves run unlocked. */
+static struct spinlock shrinker_lock = SPINLOCK_INIT;
+static uint64_t shrinks = 0, shrunk_pages = 0;
+
+#define PFN_PAGE(pfn) (&bootloader_data->page_frames[pfn])
+
+#ifdef PMEM_TRACE_SIZE
+struct pmem_trace_entry pmem_trace[PMEM_TRACE_SIZE];
+uint64_t pmem_trace_next = 0;
+#endif
+
+/* interrupt handlers may allocate pages too, so the zones are only locked
+ * with interrupts disabled */
+static uint64_t
+lock_zones(void)
+{
+    uint64_t rflags = save_interrupts();
+    spin_lock(&zone_lock);
+    return rflags;
+}
+
+static void
+unlock_zones(uint64_t rflags)
+{
+    spin_unlock(&zone_lock);
+    restore_interrupts(rflags);
+}
+
+static void free_range(struct zone*, uint64_t, uint64_t);
+
+void
+init_page_frames(void)
+{
+    /* reserve every frame, then release the ones that the allocator may manage,
+     * so that holes in the memory map stay reserved too */
+    for (uint64_t pfn = 0; pfn < bootloader_data->n_page_frames; ++pfn)
+        PFN_PAGE(pfn)->flags = PG_RESERVED;
+
+    static const uint32_t usable_types[] = {
+        EfiConventionalMemory, EfiLoaderCode, EfiLoaderData,
+    };
+
+    for (size_t i = 0; i < ARRAY_LENGTH(usable_types); ++i) {
+        for_each_memory_region(region, usable_types[i]) {
+            uint64_t pfn = region->start / PAGE_SIZE;
+            uint64_t end = region->end / PAGE_SIZE;
+            if (end > bootloader_data->n_page_frames)
+                end = bootloader_data->n_page_frames;
+            for (; pfn < end; ++pfn)
+                PFN_PAGE(pfn)->flags = 0;
+        }
+    }
+
+    /* the watermarks scale with the memory that the zones will grow into */
+    for_each_memory_region(region, EfiConventionalMemory) {
+        uint64_t end = region->end;
+        if (end > physical_memory_limit())
+            end = physical_memory_limit();
+        if (end > region->start)
+            n_pending_pages += (end - region->start) / PAGE_SIZE;
+    }
+
+    watermarks.min = n_pending_pages / WATERMARK_SHARE;
+    if (watermarks.min < WATERMARK_MIN_PAGES)
+        watermarks.min = WATERMARK_MIN_PAGES;
+    watermarks.low = watermarks.min + watermarks.min / 4;
+    watermarks.high = watermarks.min + watermarks.min / 2;
+}
+
+uint64_t
+physical_memory_limit(void)
+{
+    /* only memory below paddr_size can be reached from paddr_base, and only
+     * memory below ram_size has page frames */
+    uint64_t limit = bootloader_data->paddr_size;
+    if (limit > bootloader_data->n_page_frames * PAGE_SIZE)
+        limit = bootloader_data->n_page_frames * PAGE_SIZE;
+    return limit;
+}
+
+/* set up a zone with none of its pages free. returns NULL if there is no zone
+ * left. */
+static struct zone*
+init_zone(uint64_t base_pfn, uint64_t n_pages, unsigned node)
+{
+    if (n_zones == MAX_ZONES)
+        return NULL;
+    unsigned i = n_zones;
+    for (; i && zones[zones_by_pfn[i - 1]].base_pfn > base_pfn; --i)
+        zones_by_pfn[i] = zones_by_pfn[i - 1];
+    zones_by_pfn[i] = (uint8_t)n_zones;
+    struct zone *zone = &zones[n_zones++];
+    zone->base_pfn = base_pfn;
+    zone->n_pages = n_pages;
+    zone->node = node;
+    zone->n_free = 0;
+    for (unsigned order = 0; order <= MAX_ORDER; ++order)
+        list_init(&zone->free_lists[order]);
+    return zone;
+}
+
+/* the pages [*start, *end) of the memory map region that contains pfn that
+ * are below physical_memory_limit. returns false if no region contains pfn. */
+static bool
+memory_region_pages(uint64_t pfn, uint64_t *start, uint64_t *end)
+{
+    const struct memory_region *region;
+    if (!(region = find_memory_region(pfn * PAGE_SIZE)))
+        return false;
+    *start = region->start / PAGE_SIZE;
+    *end = region->end / PAGE_SIZE;
+    if (*end > physical_memory_limit() / PAGE_SIZE)
+        *end = physical_memory_limit() / PAGE_SIZE;
+    return true;
+}
+
+static struct zone* find_zone(uint64_t);
+
+/* grow a zone of the node that the range touches to cover the range, for when
+ * every zone is taken. returns NULL if none touches it. */
+static struct zone*
+extend_zone(uint64_t pfn, uint64_t n_pages, unsigned node)
+{
+    for (unsigned i = 0; i < n_zones; ++i) {
+        struct zone *zone = &zones[i];
+        if (zone->node != node)
+            continue;
+        if (zone->base_pfn + zone->n_pages == pfn) {
+            zone->n_pages += n_pages;
+            return zone;
+        }
+        if (zone->base_pfn == pfn + n_pages) {
+            /* still before the next zone, so zones_by_pfn stays sorted */
+            zone->base_pfn = pfn;
+            zone->n_pages += n_pages;
+            return zone;
+        }
+    }
+
+    return NULL;
+}
+
+/* free a range that is on one node */
+static void
+free_node_range(uint64_t pfn, uint64_t n_pages, unsigned node,
+                uint64_t node_start, uint64_t node_end)
+{
+    /* a zone spans the whole memory map region of the first range freed into
+     * it (as far as the region is on the same node), so that the later ranges
+     * of the region can merge with it */
+    struct zone *zone;
+    if (!(zone = find_zone(pfn))) {
+        uint64_t start = pfn, end = pfn + n_pages;
+        if (!memory_region_pages(pfn, &start, &end) || end < pfn + n_pages) {
+            start = pfn;
+            end = pfn + n_pages;
+        }
+        if (start < node_start)
+            start = node_start;
+        if (end > node_end)
+            end = node_end;
+        if (!(zone = init_zone(start, end - start, node))
+                && !(zone = extend_zone(pfn, n_pages, node))) {
+            n_dropped_pages += n_pages;
+            return;
+        }
+    }
+
+    if (!IN_RANGE(zone->base_pfn, zone->n_pages, pfn + n_pages - 1))
+        halt(); /* assert */
+    free_range(zone, pfn, n_pages);
+}
+
+void
+free_physical_range(uint64_t paddr, uint64_t n_pages)
+{
+    uint64_t pfn = paddr / PAGE_SIZE;
+    uint64_t rflags = lock_zones();
+
+    /* split the range where it crosses from one node to another */
+    while (n_pages) {
+        uint64_t node_start, node_end;
+        unsigned node = paddr_node(pfn * PAGE_SIZE, &node_start, &node_end);
+        node_start /= PAGE_SIZE;
+        node_end /= PAGE_SIZE;
+        uint64_t n = n_pages;
+        if (n > node_end - pfn)
+            n = node_end - pfn;
+        free_node_range(pfn, n, node, node_start, node_end);
+        pfn += n;
+        n_pages -= n;
+    }
+
+    unlock_zones(rflags);
+}
+
+/* free the next chunk of EfiConventionalMemory on the node. returns false if
+ * the node's memory is exhausted or if the kernel address space, which has the
+ * direct map, is not loaded yet. */
+static bool
+grow_physical_memory(unsigned node)
+{
+    if (!kernel_address_space)
+        return false;
+    int cpu = (int)this_cpu()->index;
+    if (grow_cpu == cpu)
+        return false;
+    spin_lock(&grow_lock);
+    grow_cpu = cpu;
+    bool grown = false;
+
+    const struct memory_region *region = pmem_regions[node]
+        ? pmem_regions[node] : next_memory_region(NULL, EfiConventionalMemory);
+
+    for (; region; region = next_memory_region(region, EfiConventionalMemory)) {
+        uint64_t end = region->end;
+        if (end > physical_memory_limit())
+            end = physical_memory_limit();
+        uint64_t tail = pmem_tails[node];
+        if (tail < region->start)
+            tail = region->start;
+        /* skip over the memory of other nodes */
+        uint64_t node_start, node_end;
+        while (tail < end && paddr_node(tail, &node_start, &node_end) != node)
+            tail = node_end;
+        if (tail >= end)
+            continue;
+
+        uint64_t chunk_end = (tail + ORDER_SIZE(GROW_ORDER))
+                             & ~(ORDER_SIZE(GROW_ORDER) - 1);
+        if (chunk_end > end)
+            chunk_end = end;
+        if (chunk_end > node_end)
+            chunk_end = node_end;
+        uint64_t n_pages = (chunk_end - tail) / PAGE_SIZE;
+        free_physical_range(tail, n_pages);
+        n_pending_pages -= n_pages;
+        pmem_regions[node] = region;
+        pmem_tails[node] = chunk_end;
+        grown = true;
+        break;
+    }
+
+    grow_cpu = -1;
+    spin_unlock(&grow_lock);
+    return grown;
+}
+
+/* whether the kernel keeps the loader page at paddr for itself:
+ * bootloader_data with the memory map, the numa topology, the page frame array
+ * and the kernel image. the rest of loader memory (the boot page tables, the
+ * loader's stack, pool and image) is unused once the kernel address space is
+ * loaded, except for free_memory, which the allocator already has. */
+static bool
+loader_page_kept(uint64_t paddr)
+{
+    if (IN_RANGE(VADDR_TO_PADDR(bootloader_data),
+                 BOOTLOADER_DATA_PAGES * PAGE_SIZE, paddr)
+            || IN_RANGE(VADDR_TO_PADDR(bootloader_data->numa),
+                        PAGE_SIZE, paddr)
+            || IN_RANGE(VADDR_TO_PADDR(bootloader_data->page_frames),
+                        NUM_PAGES(0, bootloader_data->n_page_frames
+                                     * sizeof(struct page)) * PAGE_SIZE,
+                        paddr))
+        return true;
+
+    for (Elf64_Half i = 0; i < bootloader_data->ehdr->e_phnum; ++i) {
+        const Elf64_Phdr *phdr = &bootloader_data->phdrs[i];
+        if (phdr->p_type == PT_LOAD
+                && IN_RANGE(PAGE_BASE(phdr->p_paddr),
+                            NUM_PAGES(phdr->p_vaddr, phdr->p_memsz)
+                            * PAGE_SIZE, paddr))
+            return true;
+    }
+
+    return false;
+}
+
+/* free the unused run [start, end) of loader memory */
+static uint64_t
+reclaim_run(uint64_t start, uint64_t end)
+{
+    if (start >= end)
+        return 0;
+    uint64_t n_pages = (end - start) / PAGE_SIZE;
+    free_physical_range(start, n_pages);
+    return n_pages;
+}
+
+uint64_t
+reclaim_loader_memory(void)
+{
+    if (!kernel_address_space)
+        halt(); /* assert */
+    static const uint32_t loader_types[] = { EfiLoaderCode, EfiLoaderData };
+    uint64_t n_reclaimed = 0;
+
+    for (size_t i = 0; i < ARRAY_LENGTH(loader_types); ++i) {
+        for_each_memory_region(region, loader_types[i]) {
+            uint64_t end = region->end;
+            if (end > physical_memory_limit())
+                end = physical_memory_limit();
+            /* the pages that are still in use split the region into runs */
+            uint64_t run = region->start;
+            for (uint64_t paddr = region->start; paddr < end;
+                    paddr += PAGE_SIZE) {
+                bool managed = IN_RANGE(
+                    VADDR_TO_PADDR(bootloader_data->free_memory),
+                    bootloader_data->n_pages * PAGE_SIZE, paddr);
+                if (!managed && !loader_page_kept(paddr))
+                    continue;
+                if (!managed)
+                    PFN_PAGE(paddr / PAGE_SIZE)->flags = PG_RESERVED;
+                n_reclaimed += reclaim_run(run, paddr);
+                run = paddr + PAGE_SIZE;
+            }
+            n_reclaimed += reclaim_run(run, end);
+        }
+    }
+
+    return n_reclaimed;
+}
+
+/* binary search of zones_by_pfn */
+static struct zone*
+find_zone(uint64_t pfn)
+{
+    unsigned lo = 0, hi = n_zones;
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        struct zone *zone = &zones[zones_by_pfn[mid]];
+        if (pfn < zone->base_pfn)
+            hi = mid;
+        else if (pfn - zone->base_pfn >= zone->n_pages)
+            lo = mid + 1;
+        else
+            return zone;
+    }
+
+    return NULL;
+}
+
+/* add the block of 2^order pages at pfn to the zone's free lists, merging it
+ * with its buddy for as long as the buddy is also free */
+static void
+free_block(struct zone *zone, uint64_t pfn, unsigned order)
+{
+    zone->n_free += ORDER_PAGES(order);
+    n_free_pages += ORDER_PAGES(order);
+
+    PFN_PAGE(pfn)->flags = 0;
+
+    for (; order < MAX_ORDER; ++order) {
+        uint64_t buddy = pfn ^ ORDER_PAGES(order);
+        struct page *page = PFN_PAGE(buddy);
+        if (!IN_RANGE(zone->base_pfn, zone->n_pages, buddy)
+                || !(page->flags & PG_FREE) || page->order != order)
+            break;
+        list_remove(PFN_TO_VADDR(buddy));
+        --zone->n_free_blocks[order];
+        page->flags = 0;
+        pfn &= ~ORDER_PAGES(order);
+    }
+
+    struct page *page = PFN_PAGE(pfn);
+    page->flags = PG_FREE;
+    page->order = (uint8_t)order;
+    list_push(&zone->free_lists[order], PFN_TO_VADDR(pfn));
+    ++zone->n_free_blocks[order];
+}
+
+/* free n_pages pages starting at pfn as the fewest naturally aligned blocks.
+ * the free lists only hold buddy blocks, so a run isn't kept as one extent,
+ * but it takes at most two blocks of each order: a bounded number of
+ * descriptors touched, however long the run is. */
+static void
+free_range(struct zone *zone, uint64_t pfn, uint64_t n_pages)
+{
+    n_zone_pages += n_pages;
+
+    while (n_pages) {
+        unsigned order = pfn ? (unsigned)__builtin_ctzll(pfn) : MAX_ORDER;
+        if (order > MAX_ORDER)
+            order = MAX_ORDER;
+        while (ORDER_PAGES(order) > n_pages)
+            --order;
+        free_block(zone, pfn, order);
+        pfn += ORDER_PAGES(order);
+        n_pages -= ORDER_PAGES(order);
+    }
+}
+
+/* the smallest order >= the given order that has a free block in the zone, or
+ * MAX_ORDER + 1 if there is none */
+static unsigned
+smallest_free_order(const struct zone *zone, unsigned order)
+{
+    for (; order <= MAX_ORDER; ++order) {
+        if (!list_empty(&zone->free_lists[order]))
+            break;
+    }
+
+    return order;
+}
+
+/* take a free block of found_order and split it down to the requested order,
+ * returning the upper halves to the free lists */
+static void*
+split_block(struct zone *zone, unsigned found_order, unsigned order)
+{
+    struct list_node *block = zone->free_lists[found_order].next;
+    list_remove(block);
+    --zone->n_free_blocks[found_order];
+    uint64_t pfn = VADDR_TO_PFN(block);
+    struct page *page = PFN_PAGE(pfn);
+    page->flags = PG_HEAD;
+    page->order = (uint8_t)order;
+
+    while (found_order > order) {
+        --found_order;
+        uint64_t buddy = pfn + ORDER_PAGES(found_order);
+        struct page *buddy_page = PFN_PAGE(buddy);
+        buddy_page->flags = PG_FREE;
+        buddy_page->order = (uint8_t)found_order;
+        list_push(&zone->free_lists[found_order], PFN_TO_VADDR(buddy));
+        ++zone->n_free_blocks[found_order];
+    }
+
+    zone->n_free -= ORDER_PAGES(order);
+    n_free_pages -= ORDER_PAGES(order);
+    if (n_zone_pages - n_free_pages > peak_used_pages)
+        peak_used_pages = n_zone_pages - n_free_pages;
+    return block;
+}
+
+/* take a block of 2^order pages from the zones of the node */
+static void*
+allocate_block(unsigned order, unsigned node)
+{
+    /* best fit over the zones: splitting the smallest sufficient block leaves
+     * the large blocks intact for large requests */
+    struct zone *best_zone = NULL;
+    unsigned best_order = MAX_ORDER + 1;
+
+    for (unsigned i = 0; i < n_zones; ++i) {
+        if (zones[i].node != node)
+            continue;
+        unsigned found_order = smallest_free_order(&zones[i], order);
+        if (found_order >= best_order)
+            continue;
+        best_zone = &zones[i];
+        best_order = found_order;
+        if (best_order == order)
+            break;
+    }
+
+    if (!best_zone)
+        return NULL;
+    return split_block(best_zone, best_order, order);
+}
+
+/* free a block given by a caller under zone_lock */
+static void
+free_checked_block(void *pages, unsigned order)
+{
+    uint64_t pfn = VADDR_TO_PFN(pages);
+    struct zone *zone = find_zone(pfn);
+    if (!zone
+            || order > MAX_ORDER
+            || pfn & (ORDER_PAGES(order) - 1)
+            || !IN_RANGE(zone->base_pfn, zone->n_pages,
+                         pfn + ORDER_PAGES(order) - 1)
+            || (PFN_PAGE(pfn)->flags & BLOCK_FLAGS) != PG_HEAD
+            || PFN_PAGE(pfn)->order != order)
+        halt(); /* assert */
+    free_block(zone, pfn, order);
+}
+
+/* pop a page from this cpu's magazine, refilling it from the zones of the
+ * node if it is empty */
+static void*
+magazine_allocate(unsigned node)
+{
+    uint64_t rflags = save_interrupts();
+    struct page_magazine *magazine = &magazines[this_cpu()->index];
+
+    if (magazine->n_pages) {
+        ++magazine->stats.alloc_hits;
+    } else {
+        ++magazine->stats.alloc_misses;
+        uint64_t zone_rflags = lock_zones();
+        while (magazine->n_pages < MAGAZINE_BATCH) {
+            void *page;
+            if (!(page = allocate_block(0, node)))
+                break;
+            magazine->pages[magazine->n_pages++] = page;
+        }
+        unlock_zones(zone_rflags);
+    }
+
+    void *page = NULL;
+    if (magazine->n_pages)
+        page = magazine->pages[--magazine->n_pages];
+    restore_interrupts(rflags);
+    return page;
+}
+
+/* push a page to this cpu's magazine, draining it to the zones if it is full.
+ * pages are only checked for validity once they are drained. */
+static void
+magazine_free(void *page)
+{
+    uint64_t rflags = save_interrupts();
+    struct page_magazine *magazine = &magazines[this_cpu()->index];
+
+    if (magazine->n_pages < MAGAZINE_SIZE) {
+        ++magazine->stats.free_hits;
+    } else {
+        ++magazine->stats.free_misses;
+        uint64_t zone_rflags = lock_zones();
+        for (unsigned i = 0; i < MAGAZINE_BATCH; ++i)
+            free_checked_block(magazine->pages[--magazine->n_pages], 0);
+        unlock_zones(zone_rflags);
+    }
+
+    magazine->pages[magazine->n_pages++] = page;
+    restore_interrupts(rflags);
+}
+
+static uint64_t
+lock_zero_pool(void)
+{
+    uint64_t rflags = save_interrupts();
+    spin_lock(&zero_pool.lock);
+    return rflags;
+}
+
+static void
+unlock_zero_pool(uint64_t rflags)
+{
+    spin_unlock(&zero_pool.lock);
+    restore_interrupts(rflags);
+}
+
+static struct pool_page*
+pool_pop(struct pool_page **list, uint64_t *n_pages)
+{
+    struct pool_page *page = *list;
+    if (page) {
+        *list = page->next;
+        --*n_pages;
+    }
+    return page;
+}
+
+static void
+pool_push(struct pool_page **list, uint64_t *n_pages, struct pool_page *page)
+{
+    page->next = *list;
+    *list = page;
+    ++*n_pages;
+}
+
+/* a zeroed page from the pool: a clean one, or else a dirty one zeroed here.
+ * returns NULL if the pool is empty. */
+static void*
+take_zeroed_page(void)
+{
+    if (!zero_pool.n_clean && !zero_pool.n_dirty)
+        return NULL;
+    uint64_t rflags = lock_zero_pool();
+    struct pool_page *page = pool_pop(&zero_pool.clean, &zero_pool.n_clean);
+    bool dirty = !page;
+    if (dirty)
+        page = pool_pop(&zero_pool.dirty, &zero_pool.n_dirty);
+    unlock_zero_pool(rflags);
+    if (page && dirty)
+        clear_page(page);
+    else if (page)
+        page->next = NULL;
+    return page;
+}
+
+/* returns false if the pool doesn't need the page */
+static bool
+give_dirty_page(void *page)
+{
+    /* checked unlocked first so that frees don't share the pool's cache line
+     * while the pool is full. under pressure, freed pages go back to the
+     * allocator instead. */
+    if (memory_pressure
+            || zero_pool.n_clean + zero_pool.n_dirty >= ZERO_POOL_TARGET)
+        return false;
+    uint64_t rflags = lock_zero_pool();
+    bool wanted = zero_pool.n_clean + zero_pool.n_dirty < ZERO_POOL_TARGET;
+    if (wanted)
+        pool_push(&zero_pool.dirty, &zero_pool.n_dirty, page);
+    unlock_zero_pool(rflags);
+    return wanted;
+}
+
+static void* allocate_untraced(unsigned, enum app_flags);
+static uint64_t available_pages(void);
+
+bool
+zero_idle_page(void)
+{
+    uint64_t rflags = lock_zero_pool();
+    struct pool_page *page = NULL;
+    bool full = zero_pool.n_clean >= ZERO_POOL_TARGET;
+    if (!full)
+        page = pool_pop(&zero_pool.dirty, &zero_pool.n_dirty);
+    unlock_zero_pool(rflags);
+    if (full)
+        return false;
+    /* pages in the pool are neither allocated nor free as far as the counters
+     * are concerned. the pool only takes fresh pages while memory is above the
+     * low watermark. */
+    if (!page && (available_pages() < watermarks.low
+                  || !(page = allocate_untraced(0, APP_NORMAL))))
+        return false;
+
+    /* the page won't be used until it is allocated, so keep it out of the
+     * cache */
+    clear_page_nocache(page);
+    rflags = lock_zero_pool();
+    pool_push(&zero_pool.clean, &zero_pool.n_clean, page);
+    unlock_zero_pool(rflags);
+    return true;
+}
+
+/* give pooled pages straight back to the zones, dirty ones first */
+static uint64_t
+shrink_zero_pool(uint64_t n_pages)
+{
+    uint64_t n_freed = 0;
+
+    for (; n_freed < n_pages; ++n_freed) {
+        uint64_t rflags = lock_zero_pool();
+        struct pool_page *page = pool_pop(&zero_pool.dirty, &zero_pool.n_dirty);
+        if (!page)
+            page = pool_pop(&zero_pool.clean, &zero_pool.n_clean);
+        unlock_zero_pool(rflags);
+        if (!page)
+            break;
+        rflags = lock_zones();
+        free_checked_block(page, 0);
+        unlock_zones(rflags);
+    }
+
+    return n_freed;
+}
+
+static uint64_t
+available_pages(void)
+{
+    return n_free_pages + n_pending_pages;
+}
+
+/* pages needed to bring memory back up to the given watermark */
+static uint64_t
+watermark_shortfall(uint64_t watermark)
+{
+    uint64_t available = available_pages();
+    return available < watermark ? watermark - available : 0;
+}
+
+/* run the shrinkers until they have freed n_pages. returns the number of pages
+ * freed. */
+static uint64_t
+run_shrinkers(uint64_t n_pages)
+{
+    uint64_t n_freed = 0;
+    unsigned n = __atomic_load_n(&n_shrinkers, __ATOMIC_ACQUIRE);
+    for (unsigned i = 0; i < n && n_freed < n_pages; ++i)
+        n_freed += shrinkers[i](n_pages - n_freed);
+    __atomic_add_fetch(&shrinks, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&shrunk_pages, n_freed, __ATOMIC_RELAXED);
+    return n_freed;
+}
+
+bool
+register_shrinker(shrinker_t *shrinker)
+{
+    uint64_t rflags = save_interrupts();
+    spin_lock(&shrinker_lock);
+    bool registered = n_shrinkers < MAX_SHRINKERS;
+    if (registered) {
+        shrinkers[n_shrinkers] = shrinker;
+        __atomic_store_n(&n_shrinkers, n_shrinkers + 1, __ATOMIC_RELEASE);
+    }
+    spin_unlock(&shrinker_lock);
+    restore_interrupts(rflags);
+    return registered;
+}
+
+bool
+set_physical_memory_watermarks(const struct physical_memory_watermarks *marks)
+{
+    if (marks->min > marks->low || marks->low > marks->high)
+        return false;
+    uint64_t rflags = lock_zones();
+    watermarks = *marks;
+    unlock_zones(rflags);
+    return true;
+}
+
+void
+get_physical_memory_watermarks(struct physical_memory_watermarks *marks)
+{
+    uint64_t rflags = lock_zones();
+    *marks = watermarks;
+    unlock_zones(rflags);
+}
+
+uint64_t
+balance_physical_memory(void)
+{
+    if (!memory_pressure)
+        return 0;
+    uint64_t n_freed = 0, n_pages;
+    if ((n_pages = watermark_shortfall(watermarks.high)))
+        n_freed = run_shrinkers(n_pages);
+    /* pages freed to the magazines don't count until they are drained, so
+     * this may take a few rounds */
+    memory_pressure = available_pages() < watermarks.high;
+    return n_freed;
+}
+
+static enum app_type
+app_type(enum app_flags flags)
+{
+    if (flags & APP_PTE)
+        return APP_TYPE_PTE;
+    if (flags & APP_FLAT)
+        return APP_TYPE_FLAT;
+    if (flags & APP_ZERO)
+        return APP_TYPE_ZERO;
+    return APP_TYPE_NORMAL;
+}
+
+void
+reset_physical_pages(void *pages, enum app_flags flags)
+{
+    struct page *page = vaddr_to_page(pages);
+    page->refcount = 1;
+    page->flags = (uint16_t)((page->flags & BLOCK_FLAGS)
+                             | (flags & APP_PTE ? PG_PAGETABLE : 0));
+    page->app_type = (uint8_t)app_type(flags);
+    page->owner = NULL;
+}
+
+/* take a block from the nearest node that has the memory, paging more of each
+ * node in before falling back to the next one */
+static void*
+allocate_nearest(unsigned order)
+{
+    const uint8_t *fallback = node_fallback(this_cpu()->node);
+    void *pages = NULL;
+
+    for (unsigned i = 0; !pages && i < numa_n_nodes(); ++i) {
+        unsigned node = fallback[i];
+        do {
+            if (order) {
+                uint64_t rflags = lock_zones();
+                pages = allocate_block(order, node);
+                unlock_zones(rflags);
+            } else {
+                pages = magazine_allocate(node);
+            }
+        } while (!pages && grow_physical_memory(node));
+    }
+
+    return pages;
+}
+
+static void*
+allocate_untraced(unsigned order, enum app_flags flags)
+{
+    if (flags & APP_PTE)
+        flags |= APP_ZERO | APP_FLAT;
+    if (order > MAX_ORDER)
+        return NULL;
+
+    void *pages = NULL;
+    if (!order && flags & APP_ZERO && (pages = take_zeroed_page()))
+        flags &= ~(enum app_flags)APP_ZERO;
+
+    /* below the min watermark, only what the shrinkers free can be handed
+     * out. page tables may use the reserve. */
+    if (!pages && !(flags & APP_PTE)
+            && watermark_shortfall(watermarks.min + ORDER_PAGES(order))
+            && !run_shrinkers(watermark_shortfall(watermarks.high)
+                              + ORDER_PAGES(order)))
+        return NULL;
+
+    if (!pages && !(pages = allocate_nearest(order))) {
+        /* out of memory on every node */
+        if (!run_shrinkers(ORDER_PAGES(order))
+                || !(pages = allocate_nearest(order)))
+            return NULL;
+    }
+
+    if (available_pages() < watermarks.low)
+        memory_pressure = true;
+    const uint8_t *fallback = node_fallback(this_cpu()->node);
+    for (unsigned i = 0; n_free_pages < GROW_RESERVE && i < numa_n_nodes();
+            ++i) {
+        if (grow_physical_memory(fallback[i]))
+            break;
+    }
+    reset_physical_pages(pages, flags);
+    if (flags & APP_ZERO) {
+        for (uint64_t i = 0; i < ORDER_PAGES(order); ++i)
+            clear_page((char*)pages + i * PAGE_SIZE);
+    }
+    if (flags & APP_FLAT)
+        return (void*)VADDR_TO_PADDR(pages);
+    return pages;
+}
+
+static void
+free_untraced(void *pages, unsigned order)
+{
+    struct page *page = vaddr_to_page(pages);
+    page->refcount = 0;
+    page->flags &= BLOCK_FLAGS;
+    page->owner = NULL;
+
+    if (!order) {
+        if (!give_dirty_page(pages))
+            magazine_free(pages);
+    } else {
+        uint64_t rflags = lock_zones();
+        free_checked_block(pages, order);
+        unlock_zones(rflags);
+    }
+
+    /* the pressure is over once frees alone bring memory back above high,
+     * even if nothing calls balance_physical_memory */
+    if (memory_pressure && available_pages() >= watermarks.high)
+        memory_pressure = false;
+}
+
+#ifdef PMEM_TRACE_SIZE
+static void
+trace(enum pmem_trace_op op, const void *caller, const void *pages,
+      unsigned order, enum app_type type)
+{
+    uint64_t i = __atomic_fetch_add(&pmem_trace_next, 1, __ATOMIC_RELAXED);
+    struct pmem_trace_entry *entry = &pmem_trace[i % PMEM_TRACE_SIZE];
+    entry->caller = caller;
+    entry->pages = pages;
+    entry->op = (uint8_t)op;
+    entry->order = (uint8_t)order;
+    entry->app_type = (uint8_t)type;
+    entry->cpu = (uint8_t)this_cpu()->index;
+}
+#endif
+
+/* the counters are per cpu, so they only need interrupts disabled */
+static void
+count_event(uint64_t *counter)
+{
+    uint64_t rflags = save_interrupts();
+    ++*counter;
+    restore_interrupts(rflags);
+}
+
+static void*
+allocate_traced(unsigned order, enum app_flags flags, const void *caller)
+{
+    void *pages = allocate_untraced(order, flags);
+    enum app_type type = app_type(flags);
+    struct page_magazine *magazine = &magazines[this_cpu()->index];
+    count_event(pages ? &magazine->allocs[type] : &magazine->failures);
+#ifdef PMEM_TRACE_SIZE
+    if (pages)
+        trace(PMEM_TRACE_ALLOC, caller, pages, order, type);
+#else
+    (void)caller;
+#endif
+    return pages;
+}
+
+static void
+free_traced(void *pages, unsigned order, const void *caller)
+{
+    /* the block is only checked once it reaches the zones, but its descriptor
+     * has to be in the array before it is read */
+    if (VADDR_TO_PFN(pages) >= bootloader_data->n_page_frames)
+        halt(); /* assert */
+    enum app_type type = vaddr_to_page(pages)->app_type;
+    if (type >= N_APP_TYPES)
+        halt(); /* assert */
+    count_event(&magazines[this_cpu()->index].frees[type]);
+#ifdef PMEM_TRACE_SIZE
+    trace(PMEM_TRACE_FREE, caller, pages, order, type);
+#else
+    (void)caller;
+#endif
+    free_untraced(pages, order);
+}
+
+void*
+allocate_physical_pages(unsigned order, enum app_flags flags)
+{
+    return allocate_traced(order, flags, __builtin_return_address(0));
+}
+
+void
+free_physical_pages(void *pages, unsigned order)
+{
+    free_traced(pages, order, __builtin_return_address(0));
+}
+
+void*
+allocate_physical_page(enum app_flags flags)
+{
+    return allocate_traced(0, flags, __builtin_return_address(0));
+}
+
+void
+free_physical_page(void *page)
+{
+    free_traced(page, 0, __builtin_return_address(0));
+}
+
+void*
+physical_block_head(const void *addr, unsigned *order)
+{
+    uint64_t pfn = VADDR_TO_PFN(addr);
+    struct zone *zone;
+    if (!(zone = find_zone(pfn)))
+        return NULL;
+
+    /* every page of a block but the first is interior, so the first page that
+     * isn't, rounding pfn down to ever larger blocks, begins the block */
+    for (unsigned k = 0; k <= MAX_ORDER; ++k) {
+        uint64_t head = pfn & ~(ORDER_PAGES(k) - 1);
+        if (head < zone->base_pfn)
+            break;
+        const struct page *page = PFN_PAGE(head);
+        if (!(page->flags & BLOCK_FLAGS))
+            continue;
+        if (!(page->flags & PG_HEAD) || pfn >= head + ORDER_PAGES(page->order))
+            break;
+        *order = page->order;
+        return PFN_TO_VADDR(head);
+    }
+
+    return NULL;
+}
+
+void
+get_physical_pages(void *pages)
+{
+    __atomic_add_fetch(&vaddr_to_page(pages)->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void
+split_physical_block(void *pages, unsigned order)
+{
+    struct page *head = vaddr_to_page(pages);
+    if (order > head->order || head->refcount != 1)
+        halt(); /* assert */
+    uint64_t n_blocks = ORDER_PAGES(head->order) / ORDER_PAGES(order);
+    for (uint64_t i = 1; i < n_blocks; ++i) {
+        struct page *page = head + i * ORDER_PAGES(order);
+        page->refcount = 1;
+        page->flags = head->flags;
+        page->order = (uint8_t)order;
+        page->app_type = head->app_type;
+        page->owner = NULL;
+    }
+    head->order = (uint8_t)order;
+
+    /* each block is freed on its own, so count them as allocations too */
+    uint64_t rflags = save_interrupts();
+    magazines[this_cpu()->index].allocs[head->app_type] += n_blocks - 1;
+    restore_interrupts(rflags);
+}
+
+void
+put_physical_pages(void *pages)
+{
+    struct page *page = vaddr_to_page(pages);
+    if (!__atomic_sub_fetch(&page->refcount, 1, __ATOMIC_ACQ_REL))
+        free_traced(pages, page->order, __builtin_return_address(0));
+}
+
+void
+get_page_magazine_stats(struct page_magazine_stats *total)
+{
+    memset(total, 0, sizeof(*total));
+
+    for (unsigned i = 0; i < n_cpus; ++i) {
+        const struct page_magazine_stats *stats = &magazines[i].stats;
+        total->alloc_hits += stats->alloc_hits;
+        total->alloc_misses += stats->alloc_misses;
+        total->free_hits += stats->free_hits;
+        total->free_misses += stats->free_misses;
+    }
+}
+
+void
+get_physical_memory_stats(struct physical_memory_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+
+    for (unsigned i = 0; i < n_cpus; ++i) {
+        const struct page_magazine *magazine = &magazines[i];
+        for (unsigned type = 0; type < N_APP_TYPES; ++type) {
+            stats->allocs[type] += magazine->allocs[type];
+            stats->frees[type] += magazine->frees[type];
+        }
+        stats->failures += magazine->failures;
+    }
+
+    stats->shrinks = shrinks;
+    stats->shrunk_pages = shrunk_pages;
+
+    uint64_t rflags = lock_zones();
+    stats->n_pages = n_zone_pages;
+    stats->n_dropped_pages = n_dropped_pages;
+    stats->n_free_pages = n_free_pages;
+    stats->n_available_pages = available_pages();
+    stats->peak_used_pages = peak_used_pages;
+    for (unsigned i = 0; i < n_zones; ++i) {
+        for (unsigned order = 0; order <= MAX_ORDER; ++order)
+            stats->n_free_blocks[order] += zones[i].n_free_blocks[order];
+    }
+    unlock_zones(rflags);
+}
+
+bool
+get_zone_stats(unsigned i, struct zone_stats *stats)
+{
+    uint64_t rflags = lock_zones();
+    bool found = i < n_zones;
+    if (found) {
+        const struct zone *zone = &zones[i];
+        stats->base_pfn = zone->base_pfn;
+        stats->n_pages = zone->n_pages;
+        stats->node = zone->node;
+        stats->n_free_pages = zone->n_free;
+        memcpy(stats->n_free_blocks, zone->n_free_blocks,
+               sizeof(stats->n_free_blocks));
+    }
+    unlock_zones(rflags);
+    return found;
+}
+
+static const char *const app_type_names[N_APP_TYPES] = {
+    [APP_TYPE_NORMAL] = "normal",
+    [APP_TYPE_ZERO] = "zero",
+    [APP_TYPE_FLAT] = "flat",
+    [APP_TYPE_PTE] = "pte",
+};
+
+void
+dump_physical_memory(write_func write)
+{
+    struct physical_memory_stats stats;
+    get_physical_memory_stats(&stats);
+    generic_printf(write, "physical memory: %lu pages, %lu free, "
+                   "%lu peak used, %lu failures, %lu dropped\n",
+                   stats.n_pages, stats.n_free_pages, stats.peak_used_pages,
+                   stats.failures, stats.n_dropped_pages);
+    for (unsigned type = 0; type < N_APP_TYPES; ++type)
+        generic_printf(write, "  %s: %lu allocs, %lu frees\n",
+                       app_type_names[type], stats.allocs[type],
+                       stats.frees[type]);
+    struct physical_memory_watermarks marks;
+    get_physical_memory_watermarks(&marks);
+    generic_printf(write, "%lu available, watermarks %lu/%lu/%lu min/low/high, "
+                   "%lu pages shrunk in %lu shrinks\n",
+                   stats.n_available_pages, marks.min, marks.low, marks.high,
+                   stats.shrunk_pages, stats.shrinks);
+
+    /* one zone at a time, to keep this off of the small kernel stack */
+    struct zone_stats zone;
+    for (unsigned i = 0; get_zone_stats(i, &zone); ++i) {
+        generic_printf(write, "zone %u: node %u, pfn %p, %lu pages, %lu free\n",
+                       i, zone.node, (void*)zone.base_pfn, zone.n_pages,
+                       zone.n_free_pages);
+        for (unsigned order = 0; order <= MAX_ORDER; ++order) {
+            if (zone.n_free_blocks[order])
+                generic_printf(write, "  order %u: %lu free blocks\n", order,
+                               zone.n_free_blocks[order]);
+        }
+    }
+
+    struct page_magazine_stats magazine_stats;
+    get_page_magazine_stats(&magazine_stats);
+    generic_printf(write, "magazines: %lu/%lu alloc hits/misses, "
+                   "%lu/%lu free hits/misses\n",
+                   magazine_stats.alloc_hits, magazine_stats.alloc_misses,
+                   magazine_stats.free_hits, magazine_stats.free_misses);
+
+#ifdef PMEM_TRACE_SIZE
+    /* oldest first. entries may be overwritten while they are printed. */
+    uint64_t next = pmem_trace_next;
+    uint64_t i = next > PMEM_TRACE_SIZE ? next - PMEM_TRACE_SIZE : 0;
+    for (; i < next; ++i) {
+        const struct pmem_trace_entry *entry = &pmem_trace[i % PMEM_TRACE_SIZE];
+        if (!entry->op || entry->app_type >= N_APP_TYPES)
+            continue;
+        generic_printf(write, "%lu: cpu %u %s %p order %u %s from %p\n", i,
+                       entry->cpu,
+                       entry->op == PMEM_TRACE_ALLOC ? "alloc" : "free",
+                       entry->pages, entry->order,
+                       app_type_names[entry->app_type], entry->caller);
+    }
+#endif
+}
@@ -0,0 +1,206 @@
+/* this module provides the physical page allocator */
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include "util.h"
+#include "generic_printf.h"
+#include "opsys/bootloader_data.h"
+#include "opsys/page.h"
+#include "opsys/virtual-memory.h"
+
+/* a block of order n is 2^n physically contiguous pages aligned to its own
+ * size. order 9 is 2MB and order 18 is 1GB. */
+#define MAX_ORDER 18
+#define ORDER_PAGES(order) (1ULL << (order))
+#define ORDER_SIZE(order) (PAGE_SIZE << (order))
+
+/* every address space maps all of physical memory below paddr_size to
+ * paddr_base (the direct map), so any frame is one add away */
+#define PADDR_TO_VADDR(paddr) \
+    ((void*)(bootloader_data->paddr_base + (uint64_t)(paddr)))
+#define VADDR_TO_PADDR(vaddr) \
+    ((uint64_t)(vaddr) - bootloader_data->paddr_base)
+#define VADDR_TO_PFN(vaddr) (VADDR_TO_PADDR(vaddr) / PAGE_SIZE)
+#define PFN_TO_VADDR(pfn) PADDR_TO_VADDR((pfn) * PAGE_SIZE)
+
+/* the descriptor of the page frame that contains vaddr, an address in the
+ * physical memory region */
+static inline struct page*
+vaddr_to_page(const void *vaddr)
+{
+    return &bootloader_data->page_frames[VADDR_TO_PFN(vaddr)];
+}
+
+enum app_flags {
+    APP_NORMAL = 0,    /* return an uninitialized new page */
+    APP_ZERO = 1 << 0, /* zero initialize the new page */
+    APP_FLAT = 1 << 1, /* return the actual physical address of the new page. */
+    APP_PTE  = 1 << 2, /* implies APP_ZERO and APP_FLAT */
+};
+
+/* allocations are counted by the most specific of their flags */
+enum app_type {
+    APP_TYPE_NORMAL,
+    APP_TYPE_ZERO,
+    APP_TYPE_FLAT,
+    APP_TYPE_PTE,
+    N_APP_TYPES,
+};
+
+/* mark the page frames outside of usable memory PG_RESERVED. called before any
+ * zone is added. */
+void init_page_frames(void);
+/* the physical address below which memory has page frames and can be reached
+ * from paddr_base */
+uint64_t physical_memory_limit(void);
+
+/* give the n_pages pages starting at the physical address paddr to the
+ * allocator, as the fewest naturally aligned free blocks: at most two per
+ * order, not one per page. the pages must be mapped in the physical memory
+ * region and never have been allocated. */
+void free_physical_range(uint64_t paddr, uint64_t n_pages);
+
+/* give the EfiLoaderCode and EfiLoaderData pages that the kernel no longer
+ * uses to the allocator, and mark the ones it does use PG_RESERVED. called
+ * once after the kernel address space is loaded. returns the number of pages
+ * reclaimed. */
+uint64_t reclaim_loader_memory(void);
+
+/* allocate 2^order contiguous pages with a reference count of 1. APP_PTE
+ * blocks are marked PG_PAGETABLE. returns NULL if no block is available. */
+__malloc void* allocate_physical_pages(unsigned order, enum app_flags);
+/* free a block that originated from allocate_physical_pages with the same
+ * order */
+void free_physical_pages(void *pages, unsigned order);
+
+/* returns NULL if out of memory */
+__malloc void* allocate_physical_page(enum app_flags);
+void free_physical_page(void *page);
+
+/* set the descriptor of an allocated block the way allocate_physical_pages
+ * would with the given flags: a reference count of 1, and PG_PAGETABLE for
+ * APP_PTE. for allocators that keep blocks of their own, like the huge page
+ * pools, as they hand them out and take them back. */
+void reset_physical_pages(void *pages, enum app_flags);
+
+/* take another reference to a block from allocate_physical_pages */
+void get_physical_pages(void *pages);
+/* drop a reference to a block, freeing it when the last one is dropped */
+void put_physical_pages(void *pages);
+/* make a block with one reference into blocks of the given smaller order,
+ * each with one reference and the flags of the block, to be freed on their
+ * own */
+void split_physical_block(void *pages, unsigned order);
+
+/* zero one page into the pool of pre-zeroed pages that APP_ZERO allocations
+ * take from. the kernel has no idle loop yet, so main2 fills the pool with it
+ * once at the end of boot. returns false if the pool is full or memory is
+ * below the low watermark. */
+bool zero_idle_page(void);
+
+/* watermarks on the available pages: the free pages in the zones plus the
+ * pages that have yet to be added to them.
+ * - an allocation that would go below min runs the shrinkers first, and fails
+ *   if they can't free anything. APP_PTE allocations may go below min, since
+ *   unmapping memory to free it may still need page tables.
+ * - below low, freed pages skip the zero pool until frees, or a call to
+ *   balance_physical_memory, bring the available pages back above high. */
+struct physical_memory_watermarks {
+    uint64_t min;
+    uint64_t low;
+    uint64_t high;
+};
+
+/* returns false unless min <= low <= high */
+bool set_physical_memory_watermarks(const struct physical_memory_watermarks*);
+void get_physical_memory_watermarks(struct physical_memory_watermarks*);
+
+/* a callback that gives up to n_pages pages that its subsystem can do without
+ * back to the allocator, returning the number of pages freed. it may free
+ * pages but must not allocate them. */
+typedef uint64_t shrinker_t(uint64_t n_pages);
+
+#define MAX_SHRINKERS 8
+/* shrinkers run in the order they are registered. the zero pool is always
+ * first. returns false if there are too many shrinkers. */
+bool register_shrinker(shrinker_t*);
+
+/* if memory is below the low watermark, run the shrinkers until it is above
+ * the high watermark. meant for idle time, but the kernel has no idle loop
+ * yet, so only the end of main2 calls it. returns the number of pages
+ * freed. */
+uint64_t balance_physical_memory(void);
+
+/* the first page of the allocated block that contains addr. *order is set to
+ * the order of the block. returns NULL if addr is not in an allocated block. */
+void* physical_block_head(const void *addr, unsigned *order);
+
+/* hit counters of the per-cpu page magazines. a miss is an operation that had
+ * to refill or drain a magazine through the zones. */
+struct page_magazine_stats {
+    uint64_t alloc_hits;
+    uint64_t alloc_misses;
+    uint64_t free_hits;
+    uint64_t free_misses;
+};
+
+/* sum the magazine counters of every cpu */
+void get_page_magazine_stats(struct page_magazine_stats*);
+
+struct physical_memory_stats {
+    uint64_t n_pages;         /* managed by the zones */
+    /* freed while every zone was taken, and never managed */
+    uint64_t n_dropped_pages;
+    /* free in the zones. pages in the magazines and the zero pool count as
+     * used. */
+    uint64_t n_free_pages;
+    uint64_t peak_used_pages;
+    uint64_t n_free_blocks[MAX_ORDER + 1]; /* of each order over all zones */
+    uint64_t allocs[N_APP_TYPES];
+    uint64_t frees[N_APP_TYPES];
+    uint64_t failures;        /* allocations that returned NULL */
+    uint64_t n_available_pages; /* as measured by the watermarks */
+    uint64_t shrinks;         /* times the shrinkers ran */
+    uint64_t shrunk_pages;    /* freed by the shrinkers */
+};
+
+struct zone_stats {
+    uint64_t base_pfn;
+    uint64_t n_pages;
+    unsigned node;
+    uint64_t n_free_pages;
+    uint64_t n_free_blocks[MAX_ORDER + 1];
+};
+
+void get_physical_memory_stats(struct physical_memory_stats*);
+/* fill in the stats of the i-th zone. returns false if there is no such
+ * zone. */
+bool get_zone_stats(unsigned i, struct zone_stats*);
+/* print the stats, and the trace if there is one */
+void dump_physical_memory(write_func);
+
+/* debug kernels record the last PMEM_TRACE_SIZE allocations and frees with
+ * their call sites in the pmem_trace ring buffer, which can also be read from
+ * gdb. entry pmem_trace_next % PMEM_TRACE_SIZE is the oldest. */
+#ifdef _KERNEL_DEBUG
+#define PMEM_TRACE_SIZE 1024
+#endif
+
+#ifdef PMEM_TRACE_SIZE
+enum pmem_trace_op {
+    PMEM_TRACE_ALLOC = 1,
+    PMEM_TRACE_FREE,
+};
+
+struct pmem_trace_entry {
+    const void *caller;
+    const void *pages;
+    uint8_t op;       /* enum pmem_trace_op, or 0 if unused */
+    uint8_t order;
+    uint8_t app_type;
+    uint8_t cpu;
+};
+
+extern struct pmem_trace_entry pmem_trace[PMEM_TRACE_SIZE];
+extern uint64_t pmem_trace_next;
+#endif
@@ -0,0 +1,53 @@
+/* this module provides output over the first serial port, a 16550 uart */
+#include <stddef.h>
+#include <stdint.h>
+#include "opsys/x86.h"
+#include "serial.h"
+
+#define COM1 0x3f8
+/* register offsets from the port base */
+#define UART_DATA 0 /* divisor latch low when DLAB is set */
+#define UART_IER  1 /* divisor latch high when DLAB is set */
+#define UART_FCR  2
+#define UART_LCR  3
+#define UART_MCR  4
+#define UART_LSR  5
+
+#define LCR_8N1  0x03
+#define LCR_DLAB 0x80
+#define FCR_ENABLE_CLEAR 0x07
+#define MCR_DTR_RTS 0x03
+#define LSR_THRE 0x20 /* transmit holding register empty */
+
+/* 115200 baud from the 1.8432MHz clock */
+#define BAUD_DIVISOR 1
+
+void
+init_serial(void)
+{
+    outb(COM1 + UART_IER, 0);
+    outb(COM1 + UART_LCR, LCR_DLAB);
+    outb(COM1 + UART_DATA, BAUD_DIVISOR & 0xff);
+    outb(COM1 + UART_IER, BAUD_DIVISOR >> 8);
+    outb(COM1 + UART_LCR, LCR_8N1);
+    outb(COM1 + UART_FCR, FCR_ENABLE_CLEAR);
+    outb(COM1 + UART_MCR, MCR_DTR_RTS);
+}
+
+static void
+serial_putc(char c)
+{
+    while (!(inb(COM1 + UART_LSR) & LSR_THRE))
+        pause();
+    outb(COM1 + UART_DATA, (uint8_t)c);
+}
+
+void
+serial_write(const char *buf, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        if (buf[i] == '\n')
+            serial_putc('\r');
+        serial_putc(buf[i]);
+    }
+}
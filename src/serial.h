@@ -0,0 +1,11 @@
+/* this module provides output over the first serial port */
+#pragma once
+#include <stddef.h>
+#include "generic_printf.h"
+
+/* set up COM1 for 115200 baud 8N1 */
+void init_serial(void);
+/* a write_func for generic_printf. newlines are sent as \r\n. */
+void serial_write(const char *buf, size_t n);
+
+#define serial_printf(...) generic_printf(serial_write, __VA_ARGS__)
@@ -0,0 +1,207 @@
+/* this module invalidates the tlb entries that other cpus have of changed page
+ * tables (tlb shootdown) */
+#include <stdbool.h>
+#include <stdint.h>
+#include "opsys/x86.h"
+#include "opsys/virtual-memory.h"
+#include "string.h"
+#include "util.h"
+#include "shootdown.h"
+#include "spinlock.h"
+#include "virtual-memory.h"
+#include "x86.h"
+
+/* what other cpus left a cpu to flush. requests that come in before the cpu
+ * gets to them are merged into one batch, so one ipi covers all of them. */
+struct tlb_mailbox {
+    struct spinlock lock;
+    bool pending;                /* batch holds requests, and an ipi is sent */
+    page_table_t *address_space; /* of the batch, or NULL for several */
+    struct tlb_batch batch;
+    uint64_t requests;           /* ever posted */
+    uint64_t flushed;            /* of the requests, how many are flushed */
+    struct shootdown_stats stats; /* of the shootdowns this cpu started */
+} __aligned(64); /* keep each cpu's mailbox on its own cache lines */
+
+static struct tlb_mailbox mailboxes[MAX_CPUS];
+
+static void merge_batch(struct tlb_batch *to, const struct tlb_batch *from);
+static bool post_batch(struct tlb_mailbox*, page_table_t *address_space,
+                       const struct tlb_batch*, uint64_t *request);
+static bool running_address_space(struct x86_64_cpu*,
+                                  page_table_t *address_space);
+static void flush_mailbox(struct x86_64_cpu*);
+
+/* add the pages of from to to. past TLB_BATCH_SIZE pages the addresses don't
+ * matter, since the whole tlb is flushed. */
+static void
+merge_batch(struct tlb_batch *to, const struct tlb_batch *from)
+{
+    if (to->n_pages + from->n_pages <= TLB_BATCH_SIZE)
+        memcpy(&to->vaddrs[to->n_pages], from->vaddrs,
+               from->n_pages * sizeof(from->vaddrs[0]));
+    to->n_pages += from->n_pages;
+    to->global = to->global || from->global;
+}
+
+/* leave the batch in the mailbox and set *request to its number. returns true
+ * if the cpu needs an ipi, i.e. nothing was pending. */
+static bool
+post_batch(struct tlb_mailbox *mailbox, page_table_t *address_space,
+           const struct tlb_batch *batch, uint64_t *request)
+{
+    spin_lock(&mailbox->lock);
+    bool was_pending = mailbox->pending;
+    if (!was_pending) {
+        mailbox->pending = true;
+        mailbox->address_space = address_space;
+        mailbox->batch.n_pages = 0;
+        mailbox->batch.global = false;
+    } else if (mailbox->address_space != address_space) {
+        mailbox->address_space = NULL;
+    }
+    merge_batch(&mailbox->batch, batch);
+    *request = ++mailbox->requests;
+    spin_unlock(&mailbox->lock);
+    return !was_pending;
+}
+
+/* whether the cpu may be running the address space. a cpu that isn't is told
+ * to flush the pcid of the address space when it loads it next. the other
+ * address spaces keep theirs. load_address_space stores cpu->address_space
+ * before it takes the stale flag of the pcid, and this reads
+ * cpu->address_space again after it sets the flag, so either this sees the
+ * cpu load the address space or the cpu sees the flag. */
+static bool
+running_address_space(struct x86_64_cpu *cpu, page_table_t *address_space)
+{
+    if (__atomic_load_n(&cpu->address_space, __ATOMIC_SEQ_CST)
+            == address_space)
+        return true;
+    mark_pcids_stale(cpu, address_space);
+    return __atomic_load_n(&cpu->address_space, __ATOMIC_SEQ_CST)
+        == address_space;
+}
+
+void
+shootdown_tlb(page_table_t *address_space, const struct tlb_batch *batch,
+              enum shootdown_mode mode)
+{
+    if (!batch->n_pages)
+        return;
+    uint64_t rflags = save_interrupts();
+    struct x86_64_cpu *self = this_cpu();
+    struct shootdown_stats *stats = &mailboxes[self->index].stats;
+    /* the request number that each cpu has to flush, or 0 */
+    uint64_t requests[MAX_CPUS] = { 0 };
+    bool any = false;
+
+    /* the page tables were changed before this, and the seq_cst accesses of
+     * running_address_space order those writes before the reads */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (unsigned i = 0; i < n_cpus; ++i) {
+        struct x86_64_cpu *cpu = &cpus[i];
+        if (cpu == self)
+            continue;
+        /* every cpu has the upper half */
+        if (!batch->global && !running_address_space(cpu, address_space)) {
+            ++stats->skipped;
+            continue;
+        }
+        any = true;
+        if (post_batch(&mailboxes[i], address_space, batch, &requests[i])) {
+            send_ipi(cpu, IPI_TLB_SHOOTDOWN);
+            ++stats->ipis;
+        } else {
+            ++stats->coalesced;
+        }
+    }
+
+    if (any) {
+        ++stats->shootdowns;
+        stats->pages += batch->n_pages;
+        if (batch->n_pages > TLB_BATCH_SIZE)
+            ++stats->full_flushes;
+    }
+
+    if (any && mode == SHOOTDOWN_SYNC) {
+        ++stats->waits;
+        for (unsigned i = 0; i < n_cpus; ++i) {
+            while (requests[i] && __atomic_load_n(&mailboxes[i].flushed,
+                                                  __ATOMIC_ACQUIRE)
+                                  < requests[i]) {
+                /* with interrupts off, another cpu waiting on this one would
+                 * never get its ipi through */
+                flush_mailbox(self);
+                pause();
+            }
+        }
+    }
+
+    restore_interrupts(rflags);
+}
+
+/* flush the batch in the cpu's mailbox, if there is one. called with
+ * interrupts disabled. */
+static void
+flush_mailbox(struct x86_64_cpu *cpu)
+{
+    struct tlb_mailbox *mailbox = &mailboxes[cpu->index];
+    if (!__atomic_load_n(&mailbox->pending, __ATOMIC_ACQUIRE))
+        return;
+
+    spin_lock(&mailbox->lock);
+    struct tlb_batch batch = mailbox->batch;
+    page_table_t *address_space = mailbox->address_space;
+    uint64_t request = mailbox->requests;
+    bool was_pending = mailbox->pending;
+    mailbox->pending = false;
+    spin_unlock(&mailbox->lock);
+    if (!was_pending)
+        return;
+
+    /* the batch is only for the loaded address space if the cpu hasn't
+     * switched since, and didn't get requests for several. the pcids of the
+     * rest are flushed when they are loaded next, and a change to the upper
+     * half starts a new generation, like drop_pcids does for this cpu's own
+     * changes. */
+    if (!address_space)
+        batch.n_pages = TLB_BATCH_SIZE + 1;
+    if (batch.global)
+        ++cpu->pcid_generation;
+    else if (address_space != cpu->address_space)
+        mark_pcids_stale(cpu, address_space);
+    flush_tlb_batch(&batch);
+    __atomic_store_n(&mailbox->flushed, request, __ATOMIC_RELEASE);
+}
+
+void
+handle_tlb_shootdown(void)
+{
+    flush_mailbox(this_cpu());
+    apic_eoi();
+}
+
+void
+flush_tlb_shootdowns(void)
+{
+    uint64_t rflags = save_interrupts();
+    flush_mailbox(this_cpu());
+    restore_interrupts(rflags);
+}
+
+void
+get_shootdown_stats(struct shootdown_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    for (unsigned i = 0; i < n_cpus; ++i) {
+        const struct shootdown_stats *cpu = &mailboxes[i].stats;
+        stats->shootdowns += cpu->shootdowns;
+        stats->ipis += cpu->ipis;
+        stats->coalesced += cpu->coalesced;
+        stats->skipped += cpu->skipped;
+        stats->pages += cpu->pages;
+        stats->full_flushes += cpu->full_flushes;
+        stats->waits += cpu->waits;
+    }
+}
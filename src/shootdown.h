@@ -0,0 +1,46 @@
+/* this module invalidates the tlb entries that other cpus have of changed page
+ * tables (tlb shootdown) */
+#pragma once
+#include <stdint.h>
+#include "opsys/virtual-memory.h"
+#include "virtual-memory.h"
+
+/* the ipi that asks a cpu to flush the batches that other cpus left it */
+#define IPI_TLB_SHOOTDOWN 0xf0
+
+enum shootdown_mode {
+    /* wait until every other cpu has flushed. needed before the old pages or
+     * page tables are reused, or when permissions are taken away. */
+    SHOOTDOWN_SYNC,
+    /* only send the ipis. enough when a stale entry grants less than the new
+     * one, since using it only causes a spurious page fault. */
+    SHOOTDOWN_ASYNC,
+};
+
+/* invalidate the pages of the batch, which changed in the address space, on
+ * the other cpus that may have them: those running the address space, or all of
+ * them for the upper half. each of them gets at most one ipi. the others flush
+ * the address space when they load it next. */
+void shootdown_tlb(page_table_t *address_space, const struct tlb_batch*,
+                   enum shootdown_mode);
+
+/* flush what other cpus left this one. called for IPI_TLB_SHOOTDOWN. */
+void handle_tlb_shootdown(void);
+/* the same without an ipi, for a cpu that spins with interrupts disabled on
+ * something that another cpu may hold while it waits on a shootdown */
+void flush_tlb_shootdowns(void);
+
+struct shootdown_stats {
+    uint64_t shootdowns; /* calls that had another cpu to flush */
+    uint64_t ipis;       /* sent */
+    /* requests that joined one that was still pending, without an ipi */
+    uint64_t coalesced;
+    /* cpus that weren't running the address space and got no ipi */
+    uint64_t skipped;
+    uint64_t pages;      /* in the batches of the shootdowns */
+    uint64_t full_flushes; /* batches over TLB_BATCH_SIZE pages */
+    uint64_t waits;      /* SHOOTDOWN_SYNC calls */
+};
+
+/* sum the counters of every cpu. pages / shootdowns is the average batch. */
+void get_shootdown_stats(struct shootdown_stats*);
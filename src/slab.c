@@ -0,0 +1,325 @@
+/* this module provides caches of fixed-size kernel objects, carved out of slabs
+ * of contiguous pages in the style of bonwick's slab allocator */
+#include <stddef.h>
+#include <stdint.h>
+#include "opsys/bootloader_data.h"
+#include "opsys/virtual-memory.h"
+#include "opsys/x86.h"
+#include "util.h"
+#include "list.h"
+#include "physical-memory.h"
+#include "slab.h"
+#include "spinlock.h"
+
+/* the largest slab is 2^SLAB_MAX_ORDER pages */
+#define SLAB_MAX_ORDER 5
+/* slabs start their objects at different multiples of the cache line size
+ * (colors) so that objects at the same index don't compete for the same cache
+ * sets */
+#define CACHE_LINE_SIZE 64
+
+/* a slab is at the start of its own 2^order pages, followed by the stack of
+ * free object indices, the color offset and then the objects. the free list is
+ * kept out of the objects so that they stay in their constructed state. */
+struct slab {
+    struct list_node node; /* in the partial, full or empty list of the cache */
+    struct kmem_cache *cache;
+    char *objects;
+    uint16_t n_free;
+    uint16_t free[];
+};
+
+struct kmem_cache {
+    struct list_node link;   /* in the list of all caches */
+    const char *name;
+    kmem_ctor_t *ctor;
+    size_t object_size;      /* rounded up to the alignment */
+    uint64_t reciprocal;     /* ceil(2^32 / object_size) */
+    unsigned order;          /* of each slab */
+    uint16_t n_objects;      /* per slab */
+    size_t objects_offset;   /* from the slab to its objects at color 0 */
+    size_t color_align;
+    unsigned n_colors;
+    unsigned next_color;
+    struct spinlock lock;
+    /* slabs with some, no and only free objects */
+    struct list_node partial, full, empty;
+};
+
+/* the kmem_cache structs themselves come from this cache */
+static struct kmem_cache cache_cache;
+
+/* every cache, for the shrinker */
+static struct list_node caches = { &caches, &caches };
+static struct spinlock caches_lock = SPINLOCK_INIT;
+
+static uint64_t
+lock_caches(void)
+{
+    uint64_t rflags = save_interrupts();
+    spin_lock(&caches_lock);
+    return rflags;
+}
+
+static void
+unlock_caches(uint64_t rflags)
+{
+    spin_unlock(&caches_lock);
+    restore_interrupts(rflags);
+}
+
+static void
+add_cache(struct kmem_cache *cache)
+{
+    uint64_t rflags = lock_caches();
+    list_push(&caches, &cache->link);
+    unlock_caches(rflags);
+}
+
+/* give the empty slabs of every cache back under memory pressure */
+static uint64_t
+shrink_caches(uint64_t n_pages)
+{
+    uint64_t n_freed = 0;
+    uint64_t rflags = lock_caches();
+    for (struct list_node *node = caches.next;
+            node != &caches && n_freed < n_pages;
+            node = node->next)
+        n_freed += kmem_cache_shrink(LIST_ENTRY(node, struct kmem_cache, link));
+    unlock_caches(rflags);
+    return n_freed;
+}
+
+static uint64_t
+lock_cache(struct kmem_cache *cache)
+{
+    uint64_t rflags = save_interrupts();
+    spin_lock(&cache->lock);
+    return rflags;
+}
+
+static void
+unlock_cache(struct kmem_cache *cache, uint64_t rflags)
+{
+    spin_unlock(&cache->lock);
+    restore_interrupts(rflags);
+}
+
+/* choose the smallest slab that wastes at most an eighth of itself */
+static bool
+init_cache(struct kmem_cache *cache, const char *name, size_t size,
+           size_t align, kmem_ctor_t *ctor)
+{
+    if (align < sizeof(void*))
+        align = sizeof(void*);
+    if (!size || align & (align - 1) || align > PAGE_SIZE)
+        return false;
+    size_t object_size = ALIGN_UP(size, align);
+    size_t n_objects = 0, objects_offset = 0, waste = 0;
+    unsigned order;
+
+    for (order = 0; order <= SLAB_MAX_ORDER; ++order) {
+        size_t slab_size = ORDER_SIZE(order);
+        n_objects = (slab_size - sizeof(struct slab))
+                    / (object_size + sizeof(uint16_t));
+        if (n_objects > UINT16_MAX)
+            n_objects = UINT16_MAX;
+        for (; n_objects; --n_objects) {
+            objects_offset = ALIGN_UP(sizeof(struct slab)
+                                      + n_objects * sizeof(uint16_t), align);
+            if (objects_offset + n_objects * object_size <= slab_size)
+                break;
+        }
+        if (!n_objects)
+            continue;
+        waste = slab_size - objects_offset - n_objects * object_size;
+        if (waste * 8 <= slab_size)
+            break;
+    }
+
+    if (!n_objects)
+        return false;
+    if (order > SLAB_MAX_ORDER)
+        order = SLAB_MAX_ORDER;
+
+    cache->name = name;
+    cache->ctor = ctor;
+    cache->object_size = object_size;
+    cache->reciprocal = (1ULL << 32) / object_size + 1;
+    cache->order = order;
+    cache->n_objects = (uint16_t)n_objects;
+    cache->objects_offset = objects_offset;
+    cache->color_align = align > CACHE_LINE_SIZE ? align : CACHE_LINE_SIZE;
+    cache->n_colors = (unsigned)(waste / cache->color_align) + 1;
+    cache->next_color = 0;
+    cache->lock = (struct spinlock)SPINLOCK_INIT;
+    list_init(&cache->partial);
+    list_init(&cache->full);
+    list_init(&cache->empty);
+    return true;
+}
+
+struct kmem_cache*
+kmem_cache_create(const char *name, size_t size, size_t align,
+                  kmem_ctor_t *ctor)
+{
+    if (!cache_cache.object_size) {
+        if (!init_cache(&cache_cache, "kmem_cache", sizeof(struct kmem_cache),
+                        0, NULL)
+                || !register_shrinker(shrink_caches))
+            halt(); /* assert */
+        add_cache(&cache_cache);
+    }
+    struct kmem_cache *cache;
+    if (!(cache = kmem_cache_alloc(&cache_cache)))
+        return NULL;
+    if (!init_cache(cache, name, size, align, ctor)) {
+        kmem_cache_free(&cache_cache, cache);
+        return NULL;
+    }
+    add_cache(cache);
+    return cache;
+}
+
+void
+kmem_cache_destroy(struct kmem_cache *cache)
+{
+    if (!list_empty(&cache->partial) || !list_empty(&cache->full))
+        halt(); /* assert */
+    uint64_t rflags = lock_caches();
+    list_remove(&cache->link);
+    unlock_caches(rflags);
+    kmem_cache_shrink(cache);
+    kmem_cache_free(&cache_cache, cache);
+}
+
+/* slabs are aligned to their size in physical memory, which paddr_base is not
+ * necessarily aligned to */
+static struct slab*
+object_slab(const struct kmem_cache *cache, const void *object)
+{
+    uint64_t paddr = (uint64_t)object - bootloader_data->paddr_base;
+    paddr &= ~(ORDER_SIZE(cache->order) - 1);
+    return (void*)(bootloader_data->paddr_base + paddr);
+}
+
+/* allocate and construct a slab of the given color */
+static struct slab*
+new_slab(struct kmem_cache *cache, unsigned color)
+{
+    struct slab *slab;
+    if (!(slab = allocate_physical_pages(cache->order, APP_NORMAL)))
+        return NULL;
+    struct page *page = vaddr_to_page(slab);
+    page->flags |= PG_SLAB;
+    page->owner = cache;
+    slab->cache = cache;
+    slab->objects = (char*)slab + cache->objects_offset
+                    + color * cache->color_align;
+    slab->n_free = cache->n_objects;
+
+    /* the lowest objects are handed out first */
+    for (uint16_t i = 0; i < cache->n_objects; ++i) {
+        slab->free[i] = (uint16_t)(cache->n_objects - 1 - i);
+        if (cache->ctor)
+            cache->ctor(slab->objects + i * cache->object_size);
+    }
+
+    return slab;
+}
+
+static void
+move_slab(struct slab *slab, struct list_node *list)
+{
+    list_remove(&slab->node);
+    list_push(list, &slab->node);
+}
+
+void*
+kmem_cache_alloc(struct kmem_cache *cache)
+{
+    uint64_t rflags = lock_cache(cache);
+    struct slab *slab;
+
+    if (!list_empty(&cache->partial)) {
+        slab = LIST_ENTRY(cache->partial.next, struct slab, node);
+    } else if (!list_empty(&cache->empty)) {
+        slab = LIST_ENTRY(cache->empty.next, struct slab, node);
+        move_slab(slab, &cache->partial);
+    } else {
+        /* the page allocator is called without the cache locked */
+        unsigned color = cache->next_color;
+        cache->next_color = (color + 1) % cache->n_colors;
+        unlock_cache(cache, rflags);
+        if (!(slab = new_slab(cache, color)))
+            return NULL;
+        rflags = lock_cache(cache);
+        list_push(&cache->partial, &slab->node);
+    }
+
+    uint16_t i = slab->free[--slab->n_free];
+    if (!slab->n_free)
+        move_slab(slab, &cache->full);
+    unlock_cache(cache, rflags);
+    return slab->objects + i * cache->object_size;
+}
+
+void
+kmem_cache_free(struct kmem_cache *cache, void *object)
+{
+    struct slab *slab = object_slab(cache, object);
+    uint64_t offset = (uint64_t)((char*)object - slab->objects);
+    uint64_t i = (offset * cache->reciprocal) >> 32;
+    if (slab->cache != cache
+            || i >= cache->n_objects
+            || i * cache->object_size != offset)
+        halt(); /* assert */
+
+    uint64_t rflags = lock_cache(cache);
+    if (slab->n_free == cache->n_objects)
+        halt(); /* assert */
+    slab->free[slab->n_free++] = (uint16_t)i;
+    if (slab->n_free == cache->n_objects)
+        move_slab(slab, &cache->empty);
+    else if (slab->n_free == 1)
+        move_slab(slab, &cache->partial);
+    unlock_cache(cache, rflags);
+}
+
+struct kmem_cache*
+kmem_slab_cache(const void *pages)
+{
+    const struct page *page = vaddr_to_page(pages);
+    return page->flags & PG_SLAB ? page->owner : NULL;
+}
+
+size_t
+kmem_cache_size(const struct kmem_cache *cache)
+{
+    return cache->object_size;
+}
+
+uint64_t
+kmem_cache_shrink(struct kmem_cache *cache)
+{
+    uint64_t rflags = lock_cache(cache);
+    struct list_node empty = cache->empty;
+    bool any = !list_empty(&cache->empty);
+    list_init(&cache->empty);
+    unlock_cache(cache, rflags);
+    if (!any)
+        return 0;
+
+    /* the detached list still points back at the cache's head */
+    empty.next->prev = empty.prev->next = &empty;
+    uint64_t n_pages = 0;
+
+    while (!list_empty(&empty)) {
+        struct slab *slab = LIST_ENTRY(empty.next, struct slab, node);
+        list_remove(&slab->node);
+        free_physical_pages(slab, cache->order);
+        n_pages += ORDER_PAGES(cache->order);
+    }
+
+    return n_pages;
+}
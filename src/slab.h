@@ -0,0 +1,35 @@
+/* this module provides caches of fixed-size kernel objects */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "util.h"
+
+struct kmem_cache;
+
+/* put a new object into its constructed state. objects are constructed once
+ * when their slab is created, so they must be freed in the constructed
+ * state. */
+typedef void kmem_ctor_t(void *object);
+
+/* create a cache of objects of the given size. align is a power of two, or 0
+ * for the default alignment. ctor may be NULL. returns NULL if out of
+ * memory. */
+struct kmem_cache* kmem_cache_create(const char *name, size_t size,
+                                     size_t align, kmem_ctor_t *ctor);
+/* destroy a cache whose objects have all been freed */
+void kmem_cache_destroy(struct kmem_cache*);
+
+/* returns NULL if out of memory */
+__malloc void* kmem_cache_alloc(struct kmem_cache*);
+/* free an object that originated from kmem_cache_alloc on the same cache */
+void kmem_cache_free(struct kmem_cache*, void *object);
+
+/* the cache that owns the slab beginning at the given page, as found by
+ * physical_block_head, or NULL if the block is not a slab */
+struct kmem_cache* kmem_slab_cache(const void *pages);
+/* the usable size of the cache's objects */
+size_t kmem_cache_size(const struct kmem_cache*);
+
+/* give the cache's empty slabs back to the page allocator. returns the number
+ * of pages freed. */
+uint64_t kmem_cache_shrink(struct kmem_cache*);
@@ -0,0 +1,35 @@
+/* this module provides spin locks for data shared between cpus */
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include "opsys/x86.h"
+
+struct spinlock {
+    volatile uint32_t locked;
+};
+
+#define SPINLOCK_INIT { .locked = 0 }
+
+static inline void
+spin_lock(struct spinlock *lock)
+{
+    while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) {
+        /* wait on a plain read so the line is only shared while spinning */
+        while (lock->locked)
+            pause();
+    }
+}
+
+/* returns false if the lock is taken */
+static inline bool
+spin_trylock(struct spinlock *lock)
+{
+    return !lock->locked
+        && !__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE);
+}
+
+static inline void
+spin_unlock(struct spinlock *lock)
+{
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
@@ -5,76 +5,277 @@
 #include "opsys/virtual-memory.h"
 #include "opsys/x86.h"
 #include "opsys/bootloader_data.h"
+#include "memory-map.h"
+#include "page-ops.h"
 #include "virtual-memory.h"
+#include "physical-memory.h"
+#include "shootdown.h"
+#include "vm-area.h"
 #include "x86.h"
 
-struct free_page {
-    struct free_page *next;
-};
+page_table_t *kernel_address_space = NULL;
+
+#define NEXT_PAGE_LEVEL(entry) \
+    ((page_table_t*)PADDR_TO_VADDR((*entry) & PTE_ADDR_MASK))
+static page_table_t* next_level(pte_t*);
+struct page_fault last_page_fault;
+/* whether level 3 entries can map 1GB pages. 2MB pages are always there in long
+ * mode. */
+static bool page_1gb __ro_after_init = false;
+/* whether CR4.PCIDE is set. without pcids every cr3 write flushes the tlb. */
+static bool pcids_enabled __ro_after_init = false;
+/* whether init_cpu set EFER.NXE, without which PTE_XD is reserved */
+static bool nx_enabled __ro_after_init = false;
+
+void
+init_virtual_memory(void)
+{
+    struct cpuid version, extended, extended_version = { 0 };
+    cpuid(CPUID_VERSION, &version);
+    cpuid(CPUID_EXTENDED_BASIC, &extended);
+    if (extended.a >= CPUID_EXTENDED_VERSION)
+        cpuid(CPUID_EXTENDED_VERSION, &extended_version);
+    page_1gb = extended_version.d & CPUID_80000001_EDX_PAGE1GB;
+    nx_enabled = read_msr(IA32_EFER) & EFER_NXE;
+
+    /* the boot page tables are in cr3 with pcid 0, which PCIDE requires. an
+     * application processor would set PCIDE the same way. */
+    if (version.c & CPUID_1_ECX_PCID && !(get_cr3() & CR3_PCID_MASK)) {
+        set_cr4(get_cr4() | CR4_PCIDE);
+        pcids_enabled = true;
+    }
+    this_cpu()->pcid_generation = 1;
+    this_cpu()->next_pcid = 1;
+}
+
+/* the pcid that the address space has on this cpu, or 0 if it has none in the
+ * current generation */
+static unsigned
+find_pcid(const struct x86_64_cpu *cpu, page_table_t *address_space)
+{
+    for (unsigned pcid = 1; pcid < N_PCIDS; ++pcid) {
+        if (cpu->pcids[pcid].address_space == address_space
+                && cpu->pcids[pcid].generation == cpu->pcid_generation)
+            return pcid;
+    }
+
+    return 0;
+}
+
+/* hand out the next pcid of this cpu to the address space. once they run out,
+ * a new generation starts and every address space has to get a new one. the
+ * stale tlb entries of a pcid are flushed when it is first loaded. */
+static unsigned
+new_pcid(struct x86_64_cpu *cpu, page_table_t *address_space)
+{
+    if (cpu->next_pcid == N_PCIDS) {
+        ++cpu->pcid_generation;
+        cpu->next_pcid = 1;
+    }
+    unsigned pcid = cpu->next_pcid++;
+    /* a cpu that sees the new address space here marks it stale after this,
+     * which only costs a flush */
+    __atomic_store_n(&cpu->pcids[pcid].stale, false, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&cpu->pcids[pcid].address_space, address_space,
+                     __ATOMIC_SEQ_CST);
+    cpu->pcids[pcid].generation = cpu->pcid_generation;
+    return pcid;
+}
+
+void
+mark_pcids_stale(struct x86_64_cpu *cpu, page_table_t *address_space)
+{
+    for (unsigned pcid = 1; pcid < N_PCIDS; ++pcid) {
+        if (!address_space
+                || __atomic_load_n(&cpu->pcids[pcid].address_space,
+                                   __ATOMIC_SEQ_CST) == address_space)
+            __atomic_store_n(&cpu->pcids[pcid].stale, true, __ATOMIC_SEQ_CST);
+    }
+}
+
+void
+flush_global_tlb(void)
+{
+    uint64_t rflags = save_interrupts();
+    uint64_t cr4 = get_cr4();
+    if (cr4 & CR4_PGE) {
+        /* x86-64-system S4.10.4.1: toggling PGE flushes every entry of every
+         * pcid, global or not */
+        set_cr4(cr4 & ~(uint64_t)CR4_PGE);
+        set_cr4(cr4);
+    } else {
+        /* without global pages, the other pcids still have to go */
+        ++this_cpu()->pcid_generation;
+        set_cr3(get_cr3() & ~CR3_NOFLUSH);
+    }
+    restore_interrupts(rflags);
+}
+
+void
+load_address_space(page_table_t *address_space)
+{
+    uint64_t cr3 = VADDR_TO_PADDR(address_space);
+    uint64_t rflags = save_interrupts();
+    struct x86_64_cpu *cpu = this_cpu();
+    /* shootdown_tlb accesses these in the opposite order (see
+     * running_address_space) */
+    __atomic_store_n(&cpu->address_space, address_space, __ATOMIC_SEQ_CST);
+    if (!pcids_enabled) {
+        set_cr3(cr3);
+        restore_interrupts(rflags);
+        return;
+    }
 
-static struct free_page *free_list = NULL;
+    /* a stale pcid is kept, but loaded without CR3_NOFLUSH */
+    unsigned pcid;
+    if ((pcid = find_pcid(cpu, address_space)))
+        cr3 |= pcid | (__atomic_exchange_n(&cpu->pcids[pcid].stale, false,
+                                           __ATOMIC_SEQ_CST)
+                       ? 0 : CR3_NOFLUSH);
+    else
+        cr3 |= new_pcid(cpu, address_space);
+    set_cr3(cr3);
+    restore_interrupts(rflags);
+}
 
-void free_physical_page(void *page)
+/* the tlb entries that this cpu has of the address space are stale. the loaded
+ * address space is taken care of with invlpg, the others lose their pcid so
+ * that they are flushed when they are loaded next. changes to the upper half
+ * are stale in every pcid. */
+static void
+drop_pcids(page_table_t *address_space, uint64_t vaddr)
 {
-    struct free_page *free_page = page;
-    free_page->next = free_list;
-    free_list = free_page;
+    if (!pcids_enabled)
+        return;
+    uint64_t rflags = save_interrupts();
+    struct x86_64_cpu *cpu = this_cpu();
+    unsigned pcid;
+    if (PAGE_LEVEL_INDEX(vaddr, 4) >= KERNEL_PML4_FIRST)
+        ++cpu->pcid_generation;
+    else if ((pcid = find_pcid(cpu, address_space))
+             && (get_cr3() & CR3_PCID_MASK) != pcid)
+        __atomic_store_n(&cpu->pcids[pcid].address_space, NULL,
+                         __ATOMIC_SEQ_CST);
+    restore_interrupts(rflags);
 }
 
-void* allocate_physical_page(enum app_flags flags)
+/* whether memory of the type is ram, which the direct map covers. mmio and
+ * reserved memory may not be safe to cache or to read speculatively. */
+static bool
+ram_type(uint32_t type)
 {
-    if (flags & APP_PTE)
-        flags |= APP_ZERO | APP_FLAT;
-    if (!free_list)
-        halt(); /* not implemented */
-    struct free_page *page = free_list;
-    free_list = free_list->next;
-    if (flags & APP_ZERO)
-        memset(page, 0, PAGE_SIZE);
-    if (flags & APP_FLAT)
-        return (void*)((uint64_t)page - bootloader_data->paddr_base);
-    return page;
+    switch (type) {
+    case EfiLoaderCode:
+    case EfiLoaderData:
+    case EfiBootServicesCode:
+    case EfiBootServicesData:
+    case EfiRuntimeServicesCode:
+    case EfiRuntimeServicesData:
+    case EfiConventionalMemory:
+    case EfiACPIReclaimMemory:
+    case EfiACPIMemoryNVS:
+        return true;
+    default:
+        return false;
+    }
 }
 
-static void map_range(page_table_t*, uint64_t, uint64_t, uint64_t, uint64_t);
-static void set_vpage_ro(page_table_t*, uint64_t);
+/* map the ram below paddr_size at paddr_base. regions that touch are mapped as
+ * one run, so that they can share large pages. */
+static bool
+map_direct(page_table_t *address_space)
+{
+    size_t n_regions;
+    const struct memory_region *regions = memory_regions(&n_regions);
+    uint64_t limit = bootloader_data->paddr_size;
+
+    for (size_t i = 0; i < n_regions;) {
+        if (!ram_type(regions[i].type) || regions[i].start >= limit) {
+            ++i;
+            continue;
+        }
+        uint64_t start = regions[i].start, end = regions[i].end;
+        for (++i; i < n_regions && regions[i].start == end
+                  && ram_type(regions[i].type); ++i)
+            end = regions[i].end;
+        if (end > limit)
+            end = limit;
+        if (!map_range(address_space, start,
+                       (uint64_t)PADDR_TO_VADDR(start),
+                       (end - start) / PAGE_SIZE, PTE_RW | PTE_G))
+            return false;
+    }
 
-/* create a new address space according to virtual-memory.md */
-page_table_t* new_address_space(void)
+    /* the kernel image is only written through its own mapping */
+    for (Elf64_Half i = 0; i < bootloader_data->ehdr->e_phnum; ++i) {
+        const Elf64_Phdr *phdr = &bootloader_data->phdrs[i];
+        if (phdr->p_type == PT_LOAD
+                && !protect_range(address_space,
+                                  (uint64_t)PADDR_TO_VADDR(
+                                      PAGE_BASE(phdr->p_paddr)),
+                                  NUM_PAGES(phdr->p_paddr, phdr->p_memsz),
+                                  0))
+            return false;
+    }
+
+    return true;
+}
+
+/* free the page tables under the table of the given level, and the table. what
+ * they map is left alone. */
+static void
+free_table_tree(page_table_t *table, unsigned level)
+{
+    for (unsigned i = 0; level > 1 && i < 512; ++i) {
+        pte_t *entry = &(*table)[i];
+        if (*entry & PTE_P && !(*entry & PTE_PS))
+            free_table_tree(NEXT_PAGE_LEVEL(entry), level - 1);
+    }
+    free_physical_page(table);
+}
+
+/* build the kernel address space according to virtual-memory.md */
+page_table_t* new_kernel_address_space(void)
 {
     page_table_t *address_space;
     if (!(address_space = allocate_physical_page(APP_ZERO)))
-        halt(); /* nomem */
-
-    map_range(address_space,
-        (uint64_t)bootloader_data - bootloader_data->paddr_base,
-        (uint64_t)bootloader_data,
-        1,
-        PTE_RW);
-    map_range(address_space,
-        (uint64_t)bootloader_data->free_memory - bootloader_data->paddr_base,
-        (uint64_t)bootloader_data->free_memory,
-        bootloader_data->n_pages,
-        PTE_RW);
-    map_range(address_space, cpu.apic.paddr, cpu.apic.vaddr, 1, PTE_RW);
+        return NULL;
+
+    /* everything here is the same in every address space, so it is all global
+     * and stays in the tlb across cr3 writes */
+
+    /* the direct map, which includes bootloader_data, free_memory, numa and
+     * page_frames */
+    if (!map_direct(address_space)
+        || !map_range(address_space, this_cpu()->apic.paddr,
+                      this_cpu()->apic.vaddr, 1, PTE_RW | PTE_G))
+        goto nomem;
 
     /* runtime segments */
-    for (UINT64 i = 0; i < bootloader_data->NumEntries; ++i) {
-        EFI_MEMORY_DESCRIPTOR *Memory = &bootloader_data->MemoryMap[i];
-        if (!(Memory->Attribute & EFI_MEMORY_RUNTIME))
+    size_t n_regions;
+    const struct memory_region *regions = memory_regions(&n_regions);
+    for (size_t i = 0; i < n_regions; ++i) {
+        const struct memory_region *region = &regions[i];
+        if (!(region->attribute & EFI_MEMORY_RUNTIME))
             continue;
-        uint64_t flags = 0;
-        if (Memory->Type == EfiRuntimeServicesData
-                || Memory->Type == EfiMemoryMappedIO
-                || Memory->Type == EfiMemoryMappedIOPortSpace)
+        /* runtime memory is at paddr_base + start, in the direct map */
+        if (ram_type(region->type)
+                && region->virt == (uint64_t)PADDR_TO_VADDR(region->start)
+                && region->end <= bootloader_data->paddr_size)
+            continue;
+        uint64_t flags = PTE_G;
+        if (region->type == EfiRuntimeServicesData
+                || region->type == EfiMemoryMappedIO
+                || region->type == EfiMemoryMappedIOPortSpace)
             flags |= PTE_RW;
         /* XXX: EfiRuntimeServicesCode needs RW?? this doesn't seem right but by
          * trial and error, runtime services code also contains r/w code
          * (specifically, the ResetSystem function) */
-        if (Memory->Type == EfiRuntimeServicesCode)
+        if (region->type == EfiRuntimeServicesCode)
             flags |= PTE_RW;
-        map_range(address_space, Memory->PhysicalStart, Memory->VirtualStart,
-                  Memory->NumberOfPages, flags);
+        if (!map_range(address_space, region->start, region->virt,
+                       (region->end - region->start) / PAGE_SIZE, flags))
+            goto nomem;
     }
 
     /* kernel segments */
@@ -86,87 +287,620 @@ page_table_t* new_address_space(void)
             relro = phdr;
         if (phdr->p_type != PT_LOAD)
             continue;
-        map_range(address_space,
-            PAGE_BASE(phdr->p_paddr),
-            PAGE_BASE(phdr->p_vaddr),
-            NUM_PAGES(phdr->p_vaddr, phdr->p_memsz),
-            phdr->p_flags & PF_W ? PTE_RW : 0);
+        if (!map_range(address_space,
+                PAGE_BASE(phdr->p_paddr),
+                PAGE_BASE(phdr->p_vaddr),
+                NUM_PAGES(phdr->p_vaddr, phdr->p_memsz),
+                (phdr->p_flags & PF_W ? PTE_RW : 0) | PTE_G))
+            goto nomem;
     }
 
-    if (relro) {
-        for (Elf64_Xword i = 0;
-                i < NUM_PAGES(relro->p_vaddr, relro->p_memsz);
-                ++i)
-            set_vpage_ro(address_space,
-                PAGE_BASE(relro->p_vaddr) + PAGE_SIZE * i);
-    }
+    if (relro && !protect_range(address_space, PAGE_BASE(relro->p_vaddr),
+                                NUM_PAGES(relro->p_vaddr, relro->p_memsz), 0))
+        goto nomem;
 
     return address_space;
+
+nomem:
+    /* nothing has loaded it yet, so no tlb has any of it */
+    free_table_tree(address_space, 4);
+    return NULL;
 }
 
-static void map_page(page_table_t*, uint64_t, uint64_t, uint64_t);
+bool
+share_kernel_half(void)
+{
+    if (!kernel_address_space)
+        halt(); /* assert */
+    for (unsigned i = KERNEL_PML4_FIRST; i < 512; ++i) {
+        if (!next_level(&(*kernel_address_space)[i]))
+            return false;
+    }
+
+    return true;
+}
 
-/* map n pages at vaddr to n pages at paddr. */
-static void map_range(page_table_t *address_space, uint64_t paddr_start,
-                      uint64_t vaddr_start, uint64_t n_pages, uint64_t flags)
+page_table_t*
+new_address_space(void)
 {
-    for (uint64_t i = 0; i < n_pages; ++i)
-        map_page(address_space,
-            paddr_start + PAGE_SIZE * i,
-            vaddr_start + PAGE_SIZE * i,
-            flags);
+    page_table_t *address_space;
+    if (!(address_space = allocate_physical_page(APP_ZERO)))
+        return NULL;
+    /* the pdpts of the upper half are shared, so kernel mappings made later
+     * show up here too */
+    for (unsigned i = KERNEL_PML4_FIRST; i < 512; ++i)
+        (*address_space)[i] = (*kernel_address_space)[i];
+    return address_space;
 }
 
-#define NEXT_PAGE_LEVEL(entry) \
-    (page_table_t*)(bootloader_data->paddr_base + ((*entry) & PTE_ADDR_MASK))
-
-/* map vpage to ppage. ppage is an actual physical page. (flat?) */
-static void map_page(page_table_t *address_space, uint64_t ppage,
-                     uint64_t vpage, uint64_t flags)
-{
-    /* x86-64-system figure 4-8
-     * opsys-loader.c map_page */
-    pte_t *level_4_e = &(*address_space)[PAGE_LEVEL_INDEX(vpage, 4)];
-    if (!(*level_4_e & PTE_P))
-        *level_4_e = (uint64_t)allocate_physical_page(APP_PTE) | PTE_P | PTE_RW;
-
-    page_table_t *level_3 = NEXT_PAGE_LEVEL(level_4_e);
-    pte_t *level_3_e = &(*level_3)[PAGE_LEVEL_INDEX(vpage, 3)];
-    if (!(*level_3_e & PTE_P))
-        *level_3_e = (uint64_t)allocate_physical_page(APP_PTE) | PTE_P | PTE_RW;
-
-    page_table_t *level_2 = NEXT_PAGE_LEVEL(level_3_e);
-    pte_t *level_2_e = &(*level_2)[PAGE_LEVEL_INDEX(vpage, 2)];
-    if (!(*level_2_e & PTE_P))
-        *level_2_e = (uint64_t)allocate_physical_page(APP_PTE) | PTE_P | PTE_RW;
-
-    page_table_t *level_1 = NEXT_PAGE_LEVEL(level_2_e);
-    pte_t *level_1_e = &(*level_1)[PAGE_LEVEL_INDEX(vpage, 1)];
-    if (*level_1_e & PTE_P)
+/* the table that entry points to, allocating it if it is not present. returns
+ * NULL if out of memory. */
+static page_table_t*
+next_level(pte_t *entry)
+{
+    if (!(*entry & PTE_P)) {
+        void *table;
+        if (!(table = allocate_physical_page(APP_PTE)))
+            return NULL;
+        /* the leaf entries decide what is writable and what user mode can
+         * reach */
+        *entry = (uint64_t)table | PTE_P | PTE_RW | PTE_US;
+    } else if (*entry & PTE_PS) {
         halt(); /* remap */
-    *level_1_e = ppage | PTE_P | flags;
+    }
+
+    return NEXT_PAGE_LEVEL(entry);
 }
 
-/* turn off the RW flag for the given virtual address */
-void set_vpage_ro(page_table_t *address_space, uint64_t vpage)
+/* the number of pages from vaddr to the end of the entry of the given level
+ * that contains it, but no more than n_pages */
+static uint64_t
+entry_pages(uint64_t vaddr, unsigned level, uint64_t n_pages)
 {
-    pte_t *level_4_e = &(*address_space)[PAGE_LEVEL_INDEX(vpage, 4)];
-    if (!(*level_4_e & PTE_P))
-        halt(); /* assert */
+    uint64_t size = PAGE_LEVEL_SIZE(level);
+    uint64_t n = (size - (vaddr & (size - 1))) / PAGE_SIZE;
+    return n < n_pages ? n : n_pages;
+}
 
-    page_table_t *level_3 = NEXT_PAGE_LEVEL(level_4_e);
-    pte_t *level_3_e = &(*level_3)[PAGE_LEVEL_INDEX(vpage, 3)];
-    if (!(*level_3_e & PTE_P))
-        halt(); /* assert */
+/* whether the n pages at vaddr can be mapped to paddr by one entry of the given
+ * level: 2MB pages at level 2, and 1GB pages at level 3 if the cpu has them */
+static bool
+fits_large_page(uint64_t paddr, uint64_t vaddr, unsigned level, uint64_t n)
+{
+    uint64_t size = PAGE_LEVEL_SIZE(level);
+    return (level == 2 || (level == 3 && page_1gb))
+        && !((paddr | vaddr) & (size - 1))
+        && n == size / PAGE_SIZE;
+}
 
-    page_table_t *level_2 = NEXT_PAGE_LEVEL(level_3_e);
-    pte_t *level_2_e = &(*level_2)[PAGE_LEVEL_INDEX(vpage, 2)];
-    if (!(*level_2_e & PTE_P))
-        halt(); /* assert */
+/* map the n_pages pages at vaddr to paddr through the given table of the given
+ * level, which they all fall under. each table is descended into once, and
+ * the leaf entries of a page table are filled in one loop.
+ * x86-64-system figure 4-8 */
+static bool
+map_level(page_table_t *table, unsigned level, uint64_t paddr, uint64_t vaddr,
+          uint64_t n_pages, uint64_t flags)
+{
+    pte_t *entry = &(*table)[PAGE_LEVEL_INDEX(vaddr, level)];
 
-    page_table_t *level_1 = NEXT_PAGE_LEVEL(level_2_e);
-    pte_t *level_1_e = &(*level_1)[PAGE_LEVEL_INDEX(vpage, 1)];
-    if (!(*level_1_e & PTE_P))
-        halt(); /* assert */
-    *level_1_e &= ~((uint64_t)PTE_RW);
+    if (level == 1) {
+        for (uint64_t i = 0; i < n_pages; ++i) {
+            if (entry[i] & PTE_P)
+                halt(); /* remap */
+            entry[i] = (paddr + PAGE_SIZE * i) | PTE_P | flags;
+        }
+        return true;
+    }
+
+    for (; n_pages; ++entry) {
+        uint64_t n = entry_pages(vaddr, level, n_pages);
+        if (fits_large_page(paddr, vaddr, level, n)) {
+            if (*entry & PTE_P)
+                halt(); /* remap */
+            *entry = paddr | PTE_P | PTE_PS | flags;
+        } else {
+            page_table_t *next;
+            if (!(next = next_level(entry))
+                    || !map_level(next, level - 1, paddr, vaddr, n, flags))
+                return false;
+        }
+        paddr += PAGE_SIZE * n;
+        vaddr += PAGE_SIZE * n;
+        n_pages -= n;
+    }
+
+    return true;
+}
+
+/* the flags without PTE_XD if the cpu has no execute disable, since setting a
+ * reserved bit would fault every access to the page */
+static uint64_t
+usable_flags(uint64_t flags)
+{
+    return nx_enabled ? flags : flags & ~(uint64_t)PTE_XD;
+}
+
+/* map n pages at vaddr to n pages at paddr, with the largest pages that fit.
+ * the ends of the range that aren't aligned get 4KB pages. */
+bool map_range(page_table_t *address_space, uint64_t paddr_start,
+               uint64_t vaddr_start, uint64_t n_pages, uint64_t flags)
+{
+    return map_level(address_space, 4, paddr_start, vaddr_start, n_pages,
+                     usable_flags(flags));
+}
+
+/* replace the large page of the given level at entry with a table of the next
+ * smaller pages with the same flags. returns false if out of memory. */
+static bool
+split_large_page(pte_t *entry, unsigned level)
+{
+    void *flat;
+    if (!(flat = allocate_physical_page(APP_PTE)))
+        return false;
+    page_table_t *table = PADDR_TO_VADDR(flat);
+    uint64_t paddr = *entry & PTE_ADDR_MASK & ~(PAGE_LEVEL_SIZE(level) - 1);
+    uint64_t flags = *entry & ~(uint64_t)PTE_ADDR_MASK;
+    if (level == 2)
+        flags &= ~(uint64_t)PTE_PS;
+
+    for (unsigned i = 0; i < 512; ++i)
+        (*table)[i] = (paddr + PAGE_LEVEL_SIZE(level - 1) * i) | flags;
+    *entry = (uint64_t)flat | PTE_P | PTE_RW;
+    return true;
+}
+
+/* a change to every leaf entry of a range */
+struct leaf_change {
+    enum { LEAF_UNMAP, LEAF_PROTECT } op;
+    page_table_t *address_space;
+    uint64_t flags;     /* the new PTE_PROT_MASK flags of LEAF_PROTECT */
+    /* whether the tlb of this cpu may hold the old entries */
+    bool loaded;
+    /* the old entries, for this cpu and for shootdown_tlb */
+    struct tlb_batch batch;
+    /* LEAF_UNMAP drops a reference to each page it unmaps. the pages that that
+     * was the last one of are linked through their descriptor's owner and
+     * freed along with the page tables. */
+    bool put_pages;
+    struct page *free_pages;
+    /* whether other cpus must flush the old entries before the change is
+     * done, i.e. some of them granted more than the new ones */
+    bool sync;
+    /* page tables that LEAF_UNMAP emptied, linked through their first entry.
+     * they are freed once the tlb no longer caches them. */
+    void *free_tables;
+};
+
+static void
+batch_page(struct tlb_batch *batch, uint64_t vaddr)
+{
+    if (batch->n_pages < TLB_BATCH_SIZE)
+        batch->vaddrs[batch->n_pages] = vaddr;
+    ++batch->n_pages;
+    if (PAGE_LEVEL_INDEX(vaddr, 4) >= KERNEL_PML4_FIRST)
+        batch->global = true;
+}
+
+void
+flush_tlb_batch(const struct tlb_batch *batch)
+{
+    if (batch->n_pages > TLB_BATCH_SIZE) {
+        /* cheaper than that many invlpgs. the kernel's mappings are global and
+         * survive a cr3 write. */
+        if (batch->global)
+            flush_global_tlb();
+        else
+            set_cr3(get_cr3());
+        return;
+    }
+
+    /* invlpg also drops the paging-structure caches of the current pcid, so
+     * this covers emptied page tables as well */
+    for (unsigned i = 0; i < batch->n_pages; ++i)
+        invlpg(batch->vaddrs[i]);
+}
+
+/* the physical address that the leaf entry of the given level maps */
+static uint64_t
+leaf_paddr(pte_t entry, unsigned level)
+{
+    /* bit 12 of a large page is its PAT bit */
+    return entry & PTE_ADDR_MASK & ~(PAGE_LEVEL_SIZE(level) - 1);
+}
+
+/* the descriptor of the allocated block that the leaf entry of the given level
+ * maps all of, or NULL if it maps something else, like part of a block, mmio
+ * or memory that the allocator doesn't manage */
+static struct page*
+leaf_block(pte_t entry, unsigned level)
+{
+    uint64_t pfn = leaf_paddr(entry, level) / PAGE_SIZE;
+    if (pfn >= bootloader_data->n_page_frames)
+        return NULL;
+    struct page *page = &bootloader_data->page_frames[pfn];
+    return page->flags & PG_HEAD && page->order == (level - 1) * 9
+        ? page : NULL;
+}
+
+/* whether the leaf entry of the given level maps part of an allocated block.
+ * its reference is the block's, so the leaf can't take one of its own. */
+static bool
+leaf_in_block(pte_t entry, unsigned level)
+{
+    unsigned order;
+    return physical_block_head(PADDR_TO_VADDR(leaf_paddr(entry, level)),
+                               &order);
+}
+
+/* a copy of what the leaf entry of the given level maps, in a new block, with
+ * the same flags. returns 0 if out of memory. */
+static pte_t
+copy_leaf(pte_t entry, unsigned level)
+{
+    uint64_t size = PAGE_LEVEL_SIZE(level);
+    const char *old = PADDR_TO_VADDR(leaf_paddr(entry, level));
+    char *copy;
+    if (!(copy = allocate_physical_pages((level - 1) * 9, APP_NORMAL)))
+        return 0;
+    for (uint64_t i = 0; i < size / PAGE_SIZE; ++i)
+        copy_page(copy + PAGE_SIZE * i, old + PAGE_SIZE * i);
+    return VADDR_TO_PADDR(copy) | (entry & ~(uint64_t)PTE_ADDR_MASK);
+}
+
+static void
+change_leaf(pte_t *entry, unsigned level, uint64_t vaddr,
+            struct leaf_change *change)
+{
+    uint64_t old = *entry;
+    struct page *page;
+    if (change->op == LEAF_UNMAP) {
+        *entry = 0;
+        change->sync = true;
+        if (change->put_pages && (page = leaf_block(old, level))) {
+            if (!__atomic_sub_fetch(&page->refcount, 1, __ATOMIC_ACQ_REL)) {
+                /* nobody else has the page, so until it is freed the
+                 * descriptor is this walk's */
+                page->owner = change->free_pages;
+                change->free_pages = page;
+            }
+        }
+    } else {
+        uint64_t flags = change->flags;
+        /* a block that another address space has can't be written in place.
+         * it stays copy on write, and copy_on_write grants the write. */
+        if (flags & PTE_RW && PAGE_LEVEL_INDEX(vaddr, 4) < KERNEL_PML4_FIRST
+                && (page = leaf_block(old, level))
+                && __atomic_load_n(&page->refcount, __ATOMIC_ACQUIRE) > 1)
+            flags = (flags & ~(uint64_t)PTE_RW) | PTE_COW;
+        uint64_t new = (old & ~(uint64_t)(PTE_PROT_MASK | PTE_COW)) | flags;
+        *entry = new;
+        if ((old & ~new & (PTE_RW | PTE_US)) || (new & ~old & PTE_XD))
+            change->sync = true;
+    }
+    batch_page(&change->batch, vaddr);
+}
+
+static bool
+table_empty(const pte_t *table)
+{
+    for (unsigned i = 0; i < 512; ++i) {
+        if (table[i] & PTE_P)
+            return false;
+    }
+
+    return true;
+}
+
+static bool unshare_leaf(page_table_t *address_space, pte_t *entry,
+                         unsigned level, uint64_t vaddr, bool write);
+
+/* before a large leaf of the lower half that maps a whole block is split, make
+ * the block private and split it as well, so that each smaller leaf maps a
+ * block of its own that it holds the reference to. a shared block is copied
+ * at its own level first. returns false if out of memory. */
+static bool
+split_leaf_block(page_table_t *address_space, pte_t *entry, unsigned level,
+                 uint64_t vaddr)
+{
+    if (PAGE_LEVEL_INDEX(vaddr, 4) >= KERNEL_PML4_FIRST
+            || !leaf_block(*entry, level))
+        return true;
+    if (!unshare_leaf(address_space, entry, level, vaddr, *entry & PTE_COW))
+        return false;
+    split_physical_block(PADDR_TO_VADDR(leaf_paddr(*entry, level)),
+                         (level - 2) * 9);
+    return true;
+}
+
+/* change the leaves of the n_pages pages at vaddr under the given table of the
+ * given level, the same way map_level walks it. a large page that is only
+ * partly in the range is split first. pages that aren't mapped are skipped.
+ * returns false if out of memory to split a large page. */
+static bool
+change_level(page_table_t *table, unsigned level, uint64_t vaddr,
+             uint64_t n_pages, struct leaf_change *change)
+{
+    pte_t *entry = &(*table)[PAGE_LEVEL_INDEX(vaddr, level)];
+
+    if (level == 1) {
+        for (uint64_t i = 0; i < n_pages; ++i) {
+            if (entry[i] & PTE_P)
+                change_leaf(&entry[i], 1, vaddr + PAGE_SIZE * i, change);
+        }
+        return true;
+    }
+
+    for (; n_pages; ++entry) {
+        uint64_t n = entry_pages(vaddr, level, n_pages);
+        bool whole = n == PAGE_LEVEL_SIZE(level) / PAGE_SIZE;
+        if (!(*entry & PTE_P)) {
+            /* nothing mapped */
+        } else if (*entry & PTE_PS && whole) {
+            change_leaf(entry, level, vaddr, change);
+        } else {
+            if (*entry & PTE_PS
+                    && (!split_leaf_block(change->address_space, entry, level,
+                                          vaddr)
+                        || !split_large_page(entry, level)))
+                return false;
+            page_table_t *next = NEXT_PAGE_LEVEL(entry);
+            if (!change_level(next, level - 1, vaddr, n, change))
+                return false;
+            /* the pdpts of the upper half are shared by every address space
+             * and stay */
+            if (change->op == LEAF_UNMAP
+                    && !(level == 4 && PAGE_LEVEL_INDEX(vaddr, 4)
+                                       >= KERNEL_PML4_FIRST)
+                    && (whole || table_empty(*next))) {
+                *entry = 0;
+                *(void**)next = change->free_tables;
+                change->free_tables = next;
+                /* the table may be cached even if none of its leaves were
+                 * present, and must be flushed everywhere before it is
+                 * freed */
+                batch_page(&change->batch, vaddr);
+                change->sync = true;
+            }
+        }
+        vaddr += PAGE_SIZE * n;
+        n_pages -= n;
+    }
+
+    return true;
+}
+
+/* whether the address space is the one in cr3 */
+static bool
+address_space_loaded(page_table_t *address_space)
+{
+    return (get_cr3() & PTE_ADDR_MASK) == VADDR_TO_PADDR(address_space);
+}
+
+/* walk the range, then flush the tlbs of this and other cpus and free the
+ * emptied page tables */
+static bool
+change_range(page_table_t *address_space, uint64_t vaddr_start,
+             uint64_t n_pages, struct leaf_change *change)
+{
+    change->address_space = address_space;
+    /* the upper half is in the loaded address space too */
+    change->loaded = address_space_loaded(address_space)
+        || PAGE_LEVEL_INDEX(vaddr_start, 4) >= KERNEL_PML4_FIRST;
+    bool changed = change_level(address_space, 4, vaddr_start, n_pages,
+                                change);
+    if (change->loaded)
+        flush_tlb_batch(&change->batch);
+    drop_pcids(address_space, vaddr_start);
+    /* emptied page tables may be in the paging-structure caches of other cpus
+     * until they flush, which LEAF_UNMAP always waits for */
+    shootdown_tlb(address_space, &change->batch,
+                  change->sync ? SHOOTDOWN_SYNC : SHOOTDOWN_ASYNC);
+
+    while (change->free_tables) {
+        void *table = change->free_tables;
+        change->free_tables = *(void**)table;
+        free_physical_page(table);
+    }
+    while (change->free_pages) {
+        struct page *page = change->free_pages;
+        change->free_pages = page->owner;
+        uint64_t pfn = (uint64_t)(page - bootloader_data->page_frames);
+        free_physical_pages(PFN_TO_VADDR(pfn), page->order);
+    }
+
+    return changed;
+}
+
+bool
+unmap_range(page_table_t *address_space, uint64_t vaddr_start,
+            uint64_t n_pages)
+{
+    struct leaf_change change = { .op = LEAF_UNMAP };
+    return change_range(address_space, vaddr_start, n_pages, &change);
+}
+
+bool
+unmap_pages(page_table_t *address_space, uint64_t vaddr_start,
+            uint64_t n_pages)
+{
+    struct leaf_change change = { .op = LEAF_UNMAP, .put_pages = true };
+    return change_range(address_space, vaddr_start, n_pages, &change);
+}
+
+bool
+protect_range(page_table_t *address_space, uint64_t vaddr_start,
+              uint64_t n_pages, uint64_t flags)
+{
+    struct leaf_change change = {
+        .op = LEAF_PROTECT,
+        .flags = usable_flags(flags & PTE_PROT_MASK),
+    };
+    return change_range(address_space, vaddr_start, n_pages, &change);
+}
+
+/* share the leaves under the table of the given level, which maps from vaddr
+ * on, with the table of the same level in to. see share_lower_half. */
+static bool
+share_level(page_table_t *from, page_table_t *to, unsigned level,
+            uint64_t vaddr, struct tlb_batch *batch)
+{
+    /* the upper half is shared already */
+    unsigned n_entries = level == 4 ? KERNEL_PML4_FIRST : 512;
+
+    for (unsigned i = 0; i < n_entries; ++i) {
+        pte_t *entry = &(*from)[i];
+        uint64_t entry_vaddr = vaddr + PAGE_LEVEL_SIZE(level) * i;
+        if (!(*entry & PTE_P))
+            continue;
+        if (level > 1 && !(*entry & PTE_PS)) {
+            page_table_t *next;
+            if (!(next = next_level(&(*to)[i]))
+                    || !share_level(NEXT_PAGE_LEVEL(entry), next, level - 1,
+                                    entry_vaddr, batch))
+                return false;
+            continue;
+        }
+
+        struct page *page;
+        if ((page = leaf_block(*entry, level))) {
+            __atomic_add_fetch(&page->refcount, 1, __ATOMIC_RELAXED);
+            if (*entry & PTE_RW) {
+                *entry = (*entry & ~(uint64_t)PTE_RW) | PTE_COW;
+                batch_page(batch, entry_vaddr);
+            }
+        } else if (leaf_in_block(*entry, level)) {
+            /* the parent may write to it or free it, so the child gets its
+             * own copy up front */
+            if (!((*to)[i] = copy_leaf(*entry, level)))
+                return false;
+            continue;
+        }
+        (*to)[i] = *entry;
+    }
+
+    return true;
+}
+
+bool
+share_lower_half(page_table_t *from, page_table_t *to)
+{
+    struct tlb_batch batch = { 0 };
+    bool shared = share_level(from, to, 4, 0, &batch);
+    /* from loses write access, which every cpu has to see before the pages
+     * are written through to */
+    if (address_space_loaded(from))
+        flush_tlb_batch(&batch);
+    drop_pcids(from, 0);
+    shootdown_tlb(from, &batch, SHOOTDOWN_SYNC);
+    return shared;
+}
+
+/* give the address space a block of its own for the leaf entry of the given
+ * level that maps vaddr: copy the block if another address space has it too.
+ * with write, the entry also becomes writable and stops being copy on write.
+ * returns false if out of memory. */
+static bool
+unshare_leaf(page_table_t *address_space, pte_t *entry, unsigned level,
+             uint64_t vaddr, bool write)
+{
+    vaddr &= ~(PAGE_LEVEL_SIZE(level) - 1);
+    uint64_t clear = write ? PTE_COW : 0, set = write ? PTE_RW : 0;
+    struct page *page = leaf_block(*entry, level);
+    struct tlb_batch batch = { 0 };
+    batch_page(&batch, vaddr);
+
+    if (page && __atomic_load_n(&page->refcount, __ATOMIC_ACQUIRE) == 1) {
+        if (!write)
+            return true;
+        /* the others have copied it already. a stale read only entry only
+         * faults again. */
+        *entry = (*entry & ~clear) | set;
+        if (address_space_loaded(address_space))
+            flush_tlb_batch(&batch);
+        shootdown_tlb(address_space, &batch, SHOOTDOWN_ASYNC);
+        return true;
+    }
+
+    pte_t copy;
+    if (!(copy = copy_leaf(*entry, level)))
+        return false;
+    uint64_t old = leaf_paddr(*entry, level);
+    *entry = (copy & ~clear) | set;
+    /* nobody may read the old page through this address space once the new
+     * one is written to */
+    if (address_space_loaded(address_space))
+        flush_tlb_batch(&batch);
+    drop_pcids(address_space, vaddr);
+    shootdown_tlb(address_space, &batch, SHOOTDOWN_SYNC);
+    if (page)
+        put_physical_pages(PADDR_TO_VADDR(old));
+    return true;
+}
+
+bool
+copy_on_write(page_table_t *address_space, pte_t *entry, unsigned level,
+              uint64_t vaddr)
+{
+    return unshare_leaf(address_space, entry, level, vaddr, true);
+}
+
+pte_t*
+find_leaf(page_table_t *address_space, uint64_t vaddr, unsigned *level_out)
+{
+    page_table_t *table = address_space;
+    for (unsigned level = 4; ; --level) {
+        pte_t *entry = &(*table)[PAGE_LEVEL_INDEX(vaddr, level)];
+        if (!(*entry & PTE_P))
+            return NULL;
+        if (level == 1 || *entry & PTE_PS) {
+            if (level_out)
+                *level_out = level;
+            return entry;
+        }
+        table = NEXT_PAGE_LEVEL(entry);
+    }
+}
+
+bool
+access_allowed(uint64_t flags, uint64_t error_code)
+{
+    return !(error_code & PFE_W && !(flags & PTE_RW))
+        && !(error_code & PFE_U && !(flags & PTE_US))
+        && !(error_code & PFE_I && flags & PTE_XD);
+}
+
+/* whether the entry allows the access that faulted. a fault like that came
+ * from a stale tlb entry that an async shootdown hasn't reached yet. */
+static bool
+spurious_fault(const pte_t *entry, uint64_t error_code)
+{
+    /* the tlb only caches present entries, and a reserved bit faults whatever
+     * the tlb has */
+    return entry && error_code & PFE_P && !(error_code & PFE_RSVD)
+        && access_allowed(*entry, error_code);
+}
+
+void handle_page_fault(const struct interrupt_frame *frame)
+{
+    uint64_t vaddr = get_cr2();
+    page_table_t *address_space =
+        PADDR_TO_VADDR(get_cr3() & PTE_ADDR_MASK);
+    if (spurious_fault(find_leaf(address_space, vaddr, NULL),
+                       frame->error_code)) {
+        invlpg(vaddr);
+        return;
+    }
+    if (handle_vm_fault(address_space, vaddr, frame->error_code))
+        return;
+
+    last_page_fault.vaddr = vaddr;
+    last_page_fault.error_code = frame->error_code;
+    last_page_fault.rip = frame->rip;
+    last_page_fault.region = NULL;
+    if (IN_RANGE(bootloader_data->paddr_base, bootloader_data->paddr_size,
+                 vaddr))
+        last_page_fault.region =
+            find_memory_region(vaddr - bootloader_data->paddr_base);
+    BREAK();
+    halt(); /* no area allows the access */
 }
@@ -1,17 +1,126 @@
 #pragma once
+#include <stdbool.h>
 #include "util.h"
 #include "opsys/virtual-memory.h"
+#include "memory-map.h"
+#include "physical-memory.h"
 
-void free_physical_page(void *page);
+struct interrupt_frame;
+struct x86_64_cpu;
 
-enum app_flags {
-    APP_NORMAL = 0,    /* return an uninitialized new page */
-    APP_ZERO = 1 << 0, /* zero initialize the new page */
-    APP_FLAT = 1 << 1, /* return the actual physical address of the new page. */
-    APP_PTE  = 1 << 2, /* implies APP_ZERO and APP_FLAT */
-};
+/* check which page sizes the cpu supports, and turn on pcids if it has them */
+void init_virtual_memory(void);
+
+/* the kernel lives in the upper half of every address space: pml4 entries
+ * KERNEL_PML4_FIRST through 511 */
+#define KERNEL_PML4_FIRST 256
+
+/* build the kernel address space according to virtual-memory.md. returns NULL
+ * if out of memory. */
+page_table_t* new_kernel_address_space(void);
 
-__malloc void* allocate_physical_page(enum app_flags);
+/* the address space that the kernel runs in. NULL until it is loaded. its
+ * upper half is the template for every other address space. */
+extern page_table_t *kernel_address_space;
 
-/* create a new address space according to virtual-memory.md */
+/* allocate every pdpt of the upper half of the kernel address space, so that
+ * the pml4 entries that new_address_space copies never change. called once
+ * the kernel address space is loaded. returns false if out of memory. */
+bool share_kernel_half(void);
+
+/* create an address space with nothing in the lower half and the kernel's pdpts
+ * in the upper half. returns NULL if out of memory. */
 page_table_t* new_address_space(void);
+
+/* past this many pages, flushing the whole tlb is cheaper than an invlpg on
+ * each */
+#define TLB_BATCH_SIZE 32
+
+/* the pages whose tlb entries a change to the page tables made stale */
+struct tlb_batch {
+    uint64_t n_pages;
+    uint64_t vaddrs[TLB_BATCH_SIZE]; /* the first TLB_BATCH_SIZE pages */
+    bool global;                     /* some are in the upper half */
+};
+
+/* invalidate the pages of the batch on this cpu: invlpg on each of them, or
+ * a flush of the whole tlb if there are more than TLB_BATCH_SIZE */
+void flush_tlb_batch(const struct tlb_batch*);
+
+/* flush every tlb entry of this cpu, including the global kernel mappings and
+ * those of other pcids. for when kernel mappings change in ways that invlpg
+ * would take too long for. */
+void flush_global_tlb(void);
+
+/* switch to the address space. with pcids, an address space that still has
+ * its pcid on this cpu keeps its tlb entries. */
+void load_address_space(page_table_t*);
+
+/* mark the pcids that the cpu has for the address space, or every pcid if it
+ * is NULL, to be flushed when they are loaded next. the cpu may be another
+ * one, as long as it isn't running the address space. */
+void mark_pcids_stale(struct x86_64_cpu*, page_table_t *address_space);
+
+/* map n_pages pages at vaddr_start to n_pages pages at paddr_start. runs that
+ * are aligned to 2MB or 1GB in both address spaces are mapped with large
+ * pages. returns false if out of memory for page tables, in which case a
+ * prefix of the range may be mapped. */
+bool map_range(page_table_t *address_space, uint64_t paddr_start,
+               uint64_t vaddr_start, uint64_t n_pages, uint64_t flags);
+
+/* the flags that protect_range changes */
+#define PTE_PROT_MASK (PTE_RW | PTE_US | PTE_XD)
+
+/* unmap the n_pages pages at vaddr_start. pages that aren't mapped are skipped,
+ * and page tables that end up empty are freed. the mapped pages themselves
+ * are not. other cpus have flushed the pages on return. returns false if out
+ * of memory to split a large page that is only partly in the range, in which
+ * case a prefix of the range may be unmapped. */
+bool unmap_range(page_table_t *address_space, uint64_t vaddr_start,
+                 uint64_t n_pages);
+/* unmap like unmap_range and drop a reference to each page that was mapped, so
+ * that the pages that nobody else has are freed. the pages must be 4KB pages
+ * or blocks from allocate_physical_pages. */
+bool unmap_pages(page_table_t *address_space, uint64_t vaddr_start,
+                 uint64_t n_pages);
+/* replace the PTE_PROT_MASK flags of the n_pages pages at vaddr_start with
+ * flags, e.g. 0 to make them read only. pages that are still shared with
+ * another address space stay PTE_COW instead of becoming writable. fails like
+ * unmap_range. */
+bool protect_range(page_table_t *address_space, uint64_t vaddr_start,
+                   uint64_t n_pages, uint64_t flags);
+
+/* the leaf entry that maps vaddr in the address space, or NULL if it is not
+ * mapped. if level is not NULL, it is set to the level of the entry. */
+pte_t* find_leaf(page_table_t *address_space, uint64_t vaddr,
+                 unsigned *level);
+/* whether the PTE_PROT_MASK flags allow the access of a page fault with the
+ * given error code */
+bool access_allowed(uint64_t flags, uint64_t error_code);
+
+/* map every page of the lower half of from into to, which has nothing mapped
+ * there. pages of allocated blocks get another reference, and the writable
+ * ones become read only and PTE_COW in both. other pages are shared as they
+ * are. returns false if out of memory for page tables, in which case part of
+ * the lower half is shared. */
+bool share_lower_half(page_table_t *from, page_table_t *to);
+
+/* resolve a write to the PTE_COW leaf entry of the given level that maps vaddr
+ * in the address space: give the address space its own copy of the page, or
+ * make the page writable if nobody else has it anymore. returns false if out
+ * of memory. */
+bool copy_on_write(page_table_t *address_space, pte_t *entry, unsigned level,
+                   uint64_t vaddr);
+
+/* the last page fault, for inspection from gdb */
+struct page_fault {
+    uint64_t vaddr;
+    uint64_t error_code;
+    uint64_t rip;
+    /* the memory map region of a fault in the physical memory region */
+    const struct memory_region *region;
+};
+
+extern struct page_fault last_page_fault;
+
+void handle_page_fault(const struct interrupt_frame*);
@@ -0,0 +1,327 @@
+/* this module provides demand paging: ranges of an address space that are
+ * reserved up front and get zeroed pages the first time they are touched, and
+ * address spaces that are cloned copy on write */
+#include <stdbool.h>
+#include <stdint.h>
+#include "opsys/x86.h"
+#include "opsys/page.h"
+#include "opsys/virtual-memory.h"
+#include "string.h"
+#include "util.h"
+#include "list.h"
+#include "physical-memory.h"
+#include "shootdown.h"
+#include "slab.h"
+#include "spinlock.h"
+#include "virtual-memory.h"
+#include "vm-area.h"
+#include "x86.h"
+
+/* the areas of an address space. it is the owner of the descriptor of the
+ * address space's pml4, so that a page fault finds it from cr3. */
+struct vm_space {
+    struct spinlock lock;
+    struct list_node areas; /* sorted by address, never overlapping */
+};
+
+static struct kmem_cache *space_cache __ro_after_init = NULL;
+static struct kmem_cache *area_cache __ro_after_init = NULL;
+
+/* counters are kept per cpu */
+static struct {
+    struct vm_fault_stats stats;
+} __aligned(64) fault_stats[MAX_CPUS];
+
+static struct vm_space* find_space(page_table_t *address_space);
+static struct vm_space* get_space(page_table_t *address_space);
+static uint64_t lock_space(struct vm_space*);
+static void unlock_space(struct vm_space*, uint64_t rflags);
+static struct vm_area* find_area(struct vm_space*, uint64_t vaddr);
+static bool copy_areas(struct vm_space *from, struct vm_space *to);
+
+void
+init_vm_areas(void)
+{
+    if (!(space_cache = kmem_cache_create("vm_space", sizeof(struct vm_space),
+                                          0, NULL))
+            || !(area_cache = kmem_cache_create("vm_area",
+                                                sizeof(struct vm_area), 0,
+                                                NULL)))
+        halt(); /* nomem */
+}
+
+/* the areas of the address space, or NULL if it never had any */
+static struct vm_space*
+find_space(page_table_t *address_space)
+{
+    return __atomic_load_n(&vaddr_to_page(address_space)->owner,
+                           __ATOMIC_ACQUIRE);
+}
+
+/* the areas of the address space, creating them if it never had any. returns
+ * NULL if out of memory. */
+static struct vm_space*
+get_space(page_table_t *address_space)
+{
+    struct vm_space *space;
+    if ((space = find_space(address_space)))
+        return space;
+    if (!(space = kmem_cache_alloc(space_cache)))
+        return NULL;
+    space->lock = (struct spinlock)SPINLOCK_INIT;
+    list_init(&space->areas);
+
+    /* another cpu may have beaten this one to it */
+    void *other = NULL;
+    if (!__atomic_compare_exchange_n(&vaddr_to_page(address_space)->owner,
+                                     &other, space, false, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE)) {
+        kmem_cache_free(space_cache, space);
+        return other;
+    }
+
+    return space;
+}
+
+/* lock the space with interrupts disabled, and return the rflags to give to
+ * unlock_space. page faults take the lock, and copy on write does shootdowns
+ * while holding it, so spinning here keeps taking shootdowns that the holder
+ * may be waiting on. */
+static uint64_t
+lock_space(struct vm_space *space)
+{
+    uint64_t rflags = save_interrupts();
+    while (!spin_trylock(&space->lock)) {
+        flush_tlb_shootdowns();
+        pause();
+    }
+    return rflags;
+}
+
+static void
+unlock_space(struct vm_space *space, uint64_t rflags)
+{
+    spin_unlock(&space->lock);
+    restore_interrupts(rflags);
+}
+
+/* the area that contains vaddr, or NULL. called with the space locked. */
+static struct vm_area*
+find_area(struct vm_space *space, uint64_t vaddr)
+{
+    for (struct list_node *node = space->areas.next; node != &space->areas;
+            node = node->next) {
+        struct vm_area *area = LIST_ENTRY(node, struct vm_area, link);
+        if (vaddr < area->start)
+            break;
+        if (vaddr < area->end)
+            return area;
+    }
+
+    return NULL;
+}
+
+bool
+reserve_range(page_table_t *address_space, uint64_t vaddr, uint64_t n_pages,
+              uint64_t flags)
+{
+    uint64_t end = vaddr + n_pages * PAGE_SIZE;
+    /* the upper half is the kernel's in every address space */
+    if (!n_pages || vaddr & (PAGE_SIZE - 1) || end <= vaddr
+            || end > KERNEL_PML4_FIRST * PAGE_LEVEL_SIZE(4))
+        return false;
+
+    struct vm_space *space;
+    struct vm_area *area;
+    if (!(space = get_space(address_space))
+            || !(area = kmem_cache_alloc(area_cache)))
+        return false;
+    area->start = vaddr;
+    area->end = end;
+    area->flags = flags & PTE_PROT_MASK;
+
+    uint64_t rflags = lock_space(space);
+    /* insert before the first area that is past the range */
+    struct list_node *node = space->areas.next;
+    for (; node != &space->areas; node = node->next) {
+        const struct vm_area *next = LIST_ENTRY(node, struct vm_area, link);
+        if (next->start >= end)
+            break;
+        if (next->end > vaddr) {
+            unlock_space(space, rflags);
+            kmem_cache_free(area_cache, area);
+            return false;
+        }
+    }
+    list_push(node->prev, &area->link);
+    unlock_space(space, rflags);
+    return true;
+}
+
+bool
+release_range(page_table_t *address_space, uint64_t vaddr, uint64_t n_pages)
+{
+    uint64_t end = vaddr + n_pages * PAGE_SIZE;
+    struct vm_space *space;
+    if (!(space = find_space(address_space)))
+        return unmap_pages(address_space, vaddr, n_pages);
+
+    uint64_t rflags = lock_space(space);
+    for (struct list_node *node = space->areas.next, *next;
+            node != &space->areas; node = next) {
+        next = node->next;
+        struct vm_area *area = LIST_ENTRY(node, struct vm_area, link);
+        if (area->start >= end)
+            break;
+        if (area->end <= vaddr)
+            continue;
+
+        if (area->start < vaddr && area->end > end) {
+            struct vm_area *split;
+            if (!(split = kmem_cache_alloc(area_cache))) {
+                unlock_space(space, rflags);
+                return false;
+            }
+            split->start = end;
+            split->end = area->end;
+            split->flags = area->flags;
+            list_push(&area->link, &split->link);
+            area->end = vaddr;
+        } else if (area->start < vaddr) {
+            area->end = vaddr;
+        } else if (area->end > end) {
+            area->start = end;
+        } else {
+            list_remove(&area->link);
+            kmem_cache_free(area_cache, area);
+        }
+    }
+    unlock_space(space, rflags);
+
+    /* faults in the range fail from here on */
+    return unmap_pages(address_space, vaddr, n_pages);
+}
+
+bool
+handle_vm_fault(page_table_t *address_space, uint64_t vaddr,
+                uint64_t error_code)
+{
+    /* every address space with areas or copy on write pages has a space */
+    struct vm_space *space = find_space(address_space);
+    bool handled = false;
+    uint64_t rflags = space ? lock_space(space) : save_interrupts();
+    struct vm_fault_stats *stats = &fault_stats[this_cpu()->index].stats;
+    const struct vm_area *area = space ? find_area(space, vaddr) : NULL;
+    unsigned level;
+    pte_t *entry = space ? find_leaf(address_space, vaddr, &level) : NULL;
+    void *page;
+
+    if (!space) {
+        /* nothing to resolve it with */
+    } else if (entry && access_allowed(*entry, error_code)) {
+        /* another cpu resolved it after this one faulted */
+        handled = true;
+        ++stats->races;
+    } else if (entry) {
+        /* a write to a page that is shared with another address space */
+        if (*entry & PTE_COW && error_code & PFE_W
+                && access_allowed(*entry | PTE_RW, error_code)
+                && (handled = copy_on_write(address_space, entry, level,
+                                            vaddr)))
+            ++stats->copies;
+    } else if (!area || !access_allowed(area->flags, error_code)) {
+        /* not ours to resolve */
+    } else if ((page = allocate_physical_page(APP_ZERO))) {
+        /* the entry wasn't present, so no tlb has it */
+        if ((handled = map_range(address_space, VADDR_TO_PADDR(page),
+                                 PAGE_BASE(vaddr), 1, area->flags)))
+            ++stats->zero_fills;
+        else
+            free_physical_page(page);
+    }
+
+    if (!handled)
+        ++stats->failures;
+    if (space)
+        unlock_space(space, rflags);
+    else
+        restore_interrupts(rflags);
+    return handled;
+}
+
+/* copy the areas of from into to, which has none. called with from locked.
+ * returns false if out of memory, in which case to has some of them. */
+static bool
+copy_areas(struct vm_space *from, struct vm_space *to)
+{
+    for (struct list_node *node = from->areas.next; node != &from->areas;
+            node = node->next) {
+        const struct vm_area *area = LIST_ENTRY(node, struct vm_area, link);
+        struct vm_area *copy;
+        if (!(copy = kmem_cache_alloc(area_cache)))
+            return false;
+        copy->start = area->start;
+        copy->end = area->end;
+        copy->flags = area->flags;
+        /* to->areas.prev is the last area */
+        list_push(to->areas.prev, &copy->link);
+    }
+
+    return true;
+}
+
+page_table_t*
+clone_address_space(page_table_t *parent)
+{
+    page_table_t *child;
+    struct vm_space *from;
+    if (!(from = get_space(parent)) || !(child = new_address_space()))
+        return NULL;
+    if (!get_space(child)) {
+        free_physical_page(child);
+        return NULL;
+    }
+
+    /* faults in the parent wait until every page is shared */
+    uint64_t rflags = lock_space(from);
+    bool cloned = copy_areas(from, find_space(child))
+        && share_lower_half(parent, child);
+    unlock_space(from, rflags);
+    if (!cloned) {
+        destroy_address_space(child);
+        return NULL;
+    }
+
+    return child;
+}
+
+void
+destroy_address_space(page_table_t *address_space)
+{
+    /* the whole lower half never splits a large page, so this can't fail */
+    release_range(address_space, 0,
+                  KERNEL_PML4_FIRST * PAGE_LEVEL_SIZE(4) / PAGE_SIZE);
+    struct vm_space *space;
+    if ((space = find_space(address_space))) {
+        vaddr_to_page(address_space)->owner = NULL;
+        kmem_cache_free(space_cache, space);
+    }
+    /* an address space that gets the pml4 next must not find this one's pcids
+     * with their tlb entries */
+    for (unsigned i = 0; i < n_cpus; ++i)
+        mark_pcids_stale(&cpus[i], address_space);
+    free_physical_page(address_space);
+}
+
+void
+get_vm_fault_stats(struct vm_fault_stats *total)
+{
+    memset(total, 0, sizeof(*total));
+    for (unsigned i = 0; i < n_cpus; ++i) {
+        const struct vm_fault_stats *stats = &fault_stats[i].stats;
+        total->zero_fills += stats->zero_fills;
+        total->races += stats->races;
+        total->copies += stats->copies;
+        total->failures += stats->failures;
+    }
+}
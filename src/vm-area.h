@@ -0,0 +1,56 @@
+/* this module provides demand paging: ranges of an address space that are
+ * reserved up front and get zeroed pages the first time they are touched, and
+ * address spaces that are cloned copy on write */
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include "list.h"
+#include "opsys/virtual-memory.h"
+
+/* a reserved range of an address space */
+struct vm_area {
+    struct list_node link; /* in the areas of the address space, by address */
+    uint64_t start;        /* page aligned */
+    uint64_t end;          /* exclusive */
+    uint64_t flags;        /* the PTE_PROT_MASK flags of its pages */
+};
+
+/* create the cache of areas. called once kmalloc works. */
+void init_vm_areas(void);
+
+/* reserve the n_pages pages at vaddr in the lower half of the address space.
+ * nothing is mapped yet: the first access to each page maps a zeroed page with
+ * the given PTE_PROT_MASK flags. returns false if the range is not in the lower
+ * half, overlaps another area, or if out of memory. */
+bool reserve_range(page_table_t *address_space, uint64_t vaddr,
+                   uint64_t n_pages, uint64_t flags);
+
+/* take the n_pages pages at vaddr out of the areas of the address space, and
+ * unmap and drop the pages that were touched. an area that the range is in the
+ * middle of is split in two. returns false if out of memory. */
+bool release_range(page_table_t *address_space, uint64_t vaddr,
+                   uint64_t n_pages);
+
+/* create an address space with the areas of the parent and every page of its
+ * lower half, shared copy on write. returns NULL if out of memory. */
+page_table_t* clone_address_space(page_table_t *parent);
+
+/* release the lower half of an address space that no cpu has loaded, and free
+ * its areas and its pml4 */
+void destroy_address_space(page_table_t*);
+
+/* resolve a page fault at vaddr with the given error code in the address
+ * space, which is in cr3. returns false if no area allows the access, or if
+ * out of memory. */
+bool handle_vm_fault(page_table_t *address_space, uint64_t vaddr,
+                     uint64_t error_code);
+
+struct vm_fault_stats {
+    uint64_t zero_fills; /* pages mapped on first touch */
+    uint64_t races;      /* faults that another cpu had resolved already */
+    uint64_t copies;     /* writes to copy on write pages */
+    uint64_t failures;   /* faults that no area allowed, or out of memory */
+};
+
+/* sum the counters of every cpu */
+void get_vm_fault_stats(struct vm_fault_stats*);
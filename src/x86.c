@@ -6,9 +6,12 @@
 #include "gdt.h"
 #include "stubs.h"
 #include "interrupts.h"
+#include "numa.h"
+#include "physical-memory.h"
 #include "x86.h"
 
-struct x86_64_cpu cpu;
+struct x86_64_cpu cpus[MAX_CPUS];
+unsigned n_cpus = 0;
 
 static void init_apic(void);
 /* alignment not necessary, but it is a page-sized table */
@@ -20,11 +23,61 @@ init_cpu(void)
 {
     set_gdt(gdt, gdt_length);
     init_segment_selectors(GDTI_KERNEL_DATA, GDTI_KERNEL_CODE);
+    /* the bootstrap processor. gs base is set after the null selector is
+     * loaded into gs. */
+    struct x86_64_cpu *cpu = &cpus[n_cpus];
+    cpu->self = cpu;
+    cpu->index = n_cpus++;
+    write_msr(IA32_GS_BASE, (uint64_t)cpu);
+    /* kernel mappings are global (see virtual-memory.md) */
+    set_cr4(get_cr4() | CR4_PGE);
+    /* read only pages are read only to the kernel too, which copy on write
+     * relies on */
+    set_cr0(get_cr0() | CR0_WP);
+    /* PTE_XD is a reserved bit until NXE is set */
+    struct cpuid extended, extended_version = { 0 };
+    cpuid(CPUID_EXTENDED_BASIC, &extended);
+    if (extended.a >= CPUID_EXTENDED_VERSION)
+        cpuid(CPUID_EXTENDED_VERSION, &extended_version);
+    if (extended_version.d & CPUID_80000001_EDX_NX)
+        write_msr(IA32_EFER, read_msr(IA32_EFER) | EFER_NXE);
     init_idt();
     set_idt(idt);
     init_apic();
 }
 
+static inline volatile uint32_t*
+apic_register(enum apic_register reg)
+{
+    return (volatile uint32_t*)(this_cpu()->apic.vaddr + reg);
+}
+
+void
+enable_apic(void)
+{
+    *apic_register(APIC_SVR) = APIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR;
+}
+
+void
+send_ipi(const struct x86_64_cpu *cpu, uint8_t vector)
+{
+    uint64_t rflags = save_interrupts();
+    /* the icr is one command split in two registers, and the low half sends
+     * it. fixed delivery, physical destination. */
+    while (*apic_register(APIC_ICR_LOW) & APIC_ICR_PENDING)
+        pause();
+    *apic_register(APIC_ICR_HIGH) =
+        (uint32_t)cpu->apic.id << APIC_ICR_DEST_SHIFT;
+    *apic_register(APIC_ICR_LOW) = vector;
+    restore_interrupts(rflags);
+}
+
+void
+apic_eoi(void)
+{
+    *apic_register(APIC_EOI) = 0;
+}
+
 static void
 init_apic(void)
 {
@@ -32,9 +85,11 @@ init_apic(void)
     uint64_t base_addr = apic_base & APIC_BASE_MASK;
     struct cpuid version;
     cpuid(CPUID_VERSION, &version);
-    cpu.apic.paddr = base_addr;
-    cpu.apic.vaddr = bootloader_data->mmio_base - PAGE_SIZE;
-    cpu.apic.id = (uint8_t)(version.b >> 24);
+    struct x86_64_cpu *cpu = this_cpu();
+    cpu->apic.paddr = base_addr;
+    cpu->apic.vaddr = bootloader_data->mmio_base - PAGE_SIZE;
+    cpu->apic.id = (uint8_t)(version.b >> 24);
+    cpu->node = apic_node(cpu->apic.id);
 }
 
 /* defined in gen/vectors.S */
@@ -1,15 +1,61 @@
 #pragma once
+#include <stdbool.h>
+#include <stdint.h>
 #include "opsys/x86.h"
+#include "opsys/virtual-memory.h"
+
+#define MAX_CPUS 16
+/* pcids that each cpu hands out to address spaces. pcid 0 is the boot page
+ * tables'. few enough that finding an address space's pcid is a short scan. */
+#define N_PCIDS 16
+
+/* the vector that the local apic gives spurious interrupts */
+#define APIC_SPURIOUS_VECTOR 0xff
 
 /* everything that is on a per-cpu basis */
 struct x86_64_cpu {
+    struct x86_64_cpu *self; /* at gs:0 so that this_cpu can find it */
+    unsigned index;          /* into cpus */
+    unsigned node;           /* numa node, from the apic id */
     struct {
         uint64_t paddr;
         uint64_t vaddr;
         uint8_t  id;
     } apic;
+    /* the address space that has each pcid. a pcid is only valid if it was
+     * handed out in the current generation. see load_address_space. */
+    struct {
+        page_table_t *address_space;
+        uint64_t generation;
+        /* set by other cpus that changed the address space while this cpu
+         * wasn't running it, to flush the pcid when it is loaded next */
+        bool stale;
+    } pcids[N_PCIDS];
+    uint64_t pcid_generation;
+    unsigned next_pcid;
+    /* the address space in cr3, for other cpus to tell whether their changes
+     * to it need an ipi */
+    page_table_t *address_space;
 };
 
-extern struct x86_64_cpu cpu;
+extern struct x86_64_cpu cpus[MAX_CPUS];
+extern unsigned n_cpus;
+
+/* the gs base of each cpu points to its own struct x86_64_cpu */
+static inline struct x86_64_cpu*
+this_cpu(void)
+{
+    struct x86_64_cpu *self;
+    __asm volatile("mov %%gs:0, %0"
+                   : "=r"(self));
+    return self;
+}
 
 void init_cpu(void);
+/* turn on the local apic of this cpu so that it can send and take ipis. called
+ * once the kernel address space, which maps the apic, is loaded. */
+void enable_apic(void);
+/* send the interrupt vector to the cpu through the local apic */
+void send_ipi(const struct x86_64_cpu*, uint8_t vector);
+/* tell the local apic that the interrupt it delivered has been handled */
+void apic_eoi(void);